@@ -25,6 +25,7 @@
 //#define XRP_REG_UART		(0x1000)
 
 #define MESSAGE_MAX_SIZE 256
+#define DSP_SRAM_SIZE    0x40000
 
 /* Address */
 #define REG_DSP_SYS_OFFSET 0x0
@@ -45,6 +46,7 @@
 
 #define REG_DSP_MSG_OFFSET 0x3F000
 #define REG_DSP_MSG   (REG_DSP_MSG_OFFSET + 0x00000000)
+#define DSP_MSG_SLOT_NUM ((DSP_SRAM_SIZE - REG_DSP_MSG_OFFSET) / MESSAGE_MAX_SIZE) // message slot per req_id (16)
 
 //#define REG_DSP_DATADRAM_OFFSET 0x001F0000
 //#define REG_DSP_STATUS  (REG_DSP_DATADRAM_OFFSET + 0x0000FFF0)
@@ -9,6 +9,7 @@
 #define __DXRT_DRV_H
 
 #include <linux/types.h>
+#include <linux/version.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/reset.h>
@@ -20,10 +21,19 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 //#include <linux/sched.h>
+#include <linux/cpumask.h>
 #include <linux/kthread.h>
 #include <linux/dma-mapping.h>
 #include <linux/delay.h>
 #include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/genalloc.h>
+#include <linux/xarray.h>
+#include <linux/sizes.h>
+#include <linux/sched.h>
+#include <linux/srcu.h>
+#include <linux/rcupdate.h>
 #include <linux/platform_device.h>
 
 #include "dxrt_drv_common.h"
@@ -37,9 +47,39 @@
 #define DX_DEVICE_MAX_NUM   (4)
 
 #define DSP_DRAM_SIZE 0x1EE00000
+#define DSP_MAILBOX_MAP_SIZE 0x1000     /* MHU registers only, the UART behind them is not used */
+#define DXRT_DRAM_CHUNK_SIZE SZ_16M     /* kernel mappings of the DRAM are made by chunks, on demand */
 #define DSP_BUFFER_UNIT_SIZE (4096*2048*3) // 24MB = 0x0180_0000
 #define DSP_BUFFER_MAX_NUM 8 // 24MB(4096*2048*3)x8 => 192MB
 
+#define DXRT_REQUEST_RING_DEPTH_DEFAULT (64)
+#define DXRT_REQUEST_RING_DEPTH_MAX     (4096)
+
+/* sysfs lists with a line per open file stop short of PAGE_SIZE, with a last "truncated" line */
+#define DXRT_SYSFS_LINE_MAX             (128)
+#define DXRT_REQUEST_BATCH_MAX          (64)    /* requests per write() / DXRT_CMD_DSP_RUN_REQ */
+#define DXRT_COMPLETION_RING_DEPTH_DEFAULT (256)
+#define DXRT_COMPLETION_RING_DEPTH_MAX     (4096)
+
+/* file_operations.uring_cmd is available from 5.19 */
+#if defined(CONFIG_IO_URING) && (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0))
+#define DXRT_HAS_URING_CMD
+#endif
+
+/* pin_user_pages / unpin_user_pages_dirty_lock / dma_map_sgtable are available from 5.8 */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0))
+#define DXRT_HAS_USERPTR
+#endif
+
+/*
+ * PMD sized PFN mappings from vm_operations_struct.huge_fault : only where PMDs have a
+ * special bit (6.12+), otherwise GUP-fast takes the DRAM pfn of such a mapping for a
+ * struct page (DX_USERPTR_REGISTER, O_DIRECT, vmsplice of a DRAM mapping)
+ */
+#if defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) && defined(CONFIG_TRANSPARENT_HUGEPAGE)
+#define DXRT_HAS_HUGE_PFNMAP
+#endif
+
 /**********************/
 /* RT/driver sync     */
 
@@ -137,19 +177,236 @@ typedef struct _dxrt_response_t {
     uint32_t  ddr_rd_bw;
 } dxrt_response_t;
 
+/* Completion record : one per request, timestamps are ktime_get_ns() */
+typedef struct _dxrt_completion_t {
+    dxrt_response_t response;   /* req_id, status, inf_time(us) */
+    uint32_t  reserved;
+    uint64_t  submit_ns;        /* request accepted by write() */
+    uint64_t  dispatch_ns;      /* message written to the DSP */
+    uint64_t  irq_ns;           /* completion IRQ */
+} dxrt_completion_t;//72B
+
+/*
+ * CMD : DXRT_CMD_DSP_RUN_REQ, data = dxrt_dsp_batch_entry_t[], size = bytes.
+ * Valid entries are queued together, 'status' is written back per entry.
+ */
+typedef struct _dxrt_dsp_batch_entry_t {
+    dxrt_dsp_request_t request;
+    int32_t   status;           /* 0 : queued, -EINVAL : rejected */
+    uint32_t  deadline_us;      /* relative deadline, 0 : the one of DX_SCHED_ADD */
+} dxrt_dsp_batch_entry_t;//136B
+
+/*
+ * Completion ring : mmap(vm_pgoff = DXRT_MMAP_COMPLETION_RING)
+ *   [dxrt_completion_ring_hdr_t][dxrt_completion_t x depth]
+ * The driver produces entries and advances 'head'.
+ * The user consumes entries [tail, head) and advances 'tail'.
+ */
+typedef struct _dxrt_completion_ring_hdr_t {
+    uint32_t  head;         /* written by driver */
+    uint32_t  tail;         /* written by user */
+    uint32_t  depth;        /* number of entries, power of 2 */
+    uint32_t  entry_size;   /* sizeof(dxrt_completion_t) */
+    uint32_t  entry_offset; /* offset of the first entry from the header */
+    uint32_t  overflow;     /* completions dropped because the ring was full */
+    uint32_t  reserved[10];
+} dxrt_completion_ring_hdr_t;//64B
+
+/*
+ * io_uring passthrough : IORING_OP_URING_CMD, cmd_op = DXRT_URING_CMD_SUBMIT,
+ * sqe->cmd = dxrt_uring_cmd_t.
+ * CQE res  : req_id on success, negative status/errno on failure
+ * CQE res2 : (inf_time(us) << 32) | req_id, with IORING_SETUP_CQE32
+ */
+typedef enum {
+    DXRT_URING_CMD_SUBMIT       = 0,
+} dxrt_uring_cmd_op_t;
+
+typedef struct _dxrt_uring_cmd_t {
+    uint64_t  request;      /* user pointer to dxrt_dsp_request_t */
+    uint64_t  reserved;
+} dxrt_uring_cmd_t;//16B
+
+/* CMD : DXRT_CMD_DMABUF */
+typedef enum {
+    DX_DMABUF_EXPORT    = 0,    /* dsp_buf_offset -> fd */
+    DX_DMABUF_IMPORT    = 1,    /* fd -> handle, dev_addr */
+    DX_DMABUF_RELEASE   = 2,    /* handle */
+} dxrt_dmabuf_sub_cmd_t;
+
+/*
+ * Imported buffers stay mapped for the DSP until DX_DMABUF_RELEASE or close().
+ * dev_addr is the DSP view of the buffer, to be placed in the request messages.
+ */
+typedef struct _dxrt_dmabuf_t {
+    uint32_t  dsp_buf_offset;   /* export : buffer from DXRT_CMD_ALLOC_DSP_BUF on the same fd */
+    uint32_t  size;             /* out : size of the buffer */
+    int32_t   fd;               /* export : out, import : in */
+    uint32_t  flags;            /* export : O_CLOEXEC, O_RDWR */
+    uint64_t  dev_addr;         /* import : out */
+    uint32_t  handle;           /* import : out, release : in */
+    uint32_t  reserved;
+} dxrt_dmabuf_t;//32B
+
+/*
+ * CMD : DXRT_CMD_USERPTR
+ * A user buffer is pinned and mapped once, then used by the DSP directly through
+ * its device address (nents == 1) or its segment list (DX_USERPTR_GET_SG).
+ * The CPU and the DSP hand over the buffer with DX_USERPTR_SYNC.
+ */
+typedef enum {
+    DX_USERPTR_REGISTER     = 0,    /* addr, size, flags -> handle, dev_addr, nents */
+    DX_USERPTR_UNREGISTER   = 1,    /* handle */
+    DX_USERPTR_GET_SG       = 2,    /* handle, nents, sg -> dxrt_userptr_sg_t[nents] */
+    DX_USERPTR_SYNC         = 3,    /* handle, flags = DX_USERPTR_TO_DEVICE or DX_USERPTR_FROM_DEVICE */
+} dxrt_userptr_sub_cmd_t;
+
+#define DX_USERPTR_TO_DEVICE    BIT(0)  /* read by the DSP */
+#define DX_USERPTR_FROM_DEVICE  BIT(1)  /* written by the DSP */
+
+typedef struct _dxrt_userptr_t {
+    uint64_t  addr;             /* register : user virtual address */
+    uint64_t  size;             /* register : bytes */
+    uint64_t  dev_addr;         /* register : out, 0 if the buffer is not contiguous for the DSP */
+    uint64_t  sg;               /* get_sg : user pointer to dxrt_userptr_sg_t[nents] */
+    uint32_t  flags;            /* DX_USERPTR_TO_DEVICE | DX_USERPTR_FROM_DEVICE */
+    uint32_t  handle;           /* register : out, others : in */
+    uint32_t  nents;            /* register : out, get_sg : in */
+    uint32_t  reserved;
+} dxrt_userptr_t;//48B
+
+typedef struct _dxrt_userptr_sg_t {
+    uint64_t  dev_addr;
+    uint32_t  len;
+    uint32_t  reserved;
+} dxrt_userptr_sg_t;//16B
+
+typedef enum {
+    DXRT_MMAP_DRAM              = 0,
+    DXRT_MMAP_SRAM              = 1,
+    DXRT_MMAP_DMA_BUF           = 2,
+    DXRT_MMAP_COMPLETION_RING   = 3,
+    DXRT_MMAP_DRAM_CACHED       = 4,    /* DRAM, cacheable : sync with DXRT_CMD_CPU_CACHE_FLUSH */
+    DXRT_MMAP_DRAM_WC           = 5,    /* DRAM, write-combining : sequential input uploads */
+    DXRT_MMAP_SRAM_WC           = 6,    /* SRAM, write-combining */
+} dxrt_mmap_pgoff_t;
+
+/*
+ * CMD : DXRT_CMD_STAGING
+ * Staging buffers owned by the file between DX_STAGING_ACQUIRE and DX_STAGING_RELEASE
+ * (or close()), as an alternative to the shared dma buffer (DXRT_MMAP_DMA_BUF) used by
+ * DXRT_CMD_WRITE_MEM / READ_MEM on every channel.
+ */
+typedef enum {
+    DX_STAGING_ACQUIRE  = 0,    /* flags -> ch, dev_addr, size */
+    DX_STAGING_RELEASE  = 1,    /* ch */
+    DX_STAGING_WRITE    = 2,    /* data = dxrt_req_meminfo_t : DXRT_CMD_WRITE_MEM to the owned buffer ch */
+    DX_STAGING_READ     = 3,    /* data = dxrt_req_meminfo_t : DXRT_CMD_READ_MEM from the owned buffer ch */
+} dxrt_staging_sub_cmd_t;
+
+#define DX_STAGING_NONBLOCK     BIT(0)  /* -EBUSY instead of waiting for a free buffer */
+
+typedef struct _dxrt_staging_t {
+    uint32_t  ch;
+    uint32_t  flags;
+    uint64_t  dev_addr;         /* DSP address of the buffer */
+    uint32_t  size;
+    uint32_t  reserved;
+} dxrt_staging_t;//24B
+
+/* CMD : DXRT_CMD_MMAP_POPULATE, range of a DRAM / SRAM mapping of the same fd */
+typedef struct _dxrt_mmap_populate_t {
+    uint64_t  addr;
+    uint64_t  size;
+} dxrt_mmap_populate_t;//16B
+
+/*
+ * CMD : DXRT_CMD_CPU_CACHE_FLUSH, data = dxrt_meminfo_t (base + offset, size in the DSP DRAM)
+ * Cache maintenance of the DXRT_MMAP_DRAM_CACHED mapping, for exactly the range given,
+ * which must lie in one buffer allocated through the same fd.
+ */
+typedef enum {
+    DX_CACHE_FLUSH              = 0,    /* clean + invalidate */
+    DX_CACHE_BEGIN_CPU_READ     = 1,    /* invalidate : DSP output, before the CPU reads it */
+    DX_CACHE_END_CPU_WRITE      = 2,    /* clean : DSP input, after the CPU wrote it */
+} dxrt_cache_sub_cmd_t;
+
+/*
+ * CMD : DXRT_CMD_ALLOC_DSP_BUF / DXRT_CMD_FREE_DSP_BUF
+ * alloc : alloc_size = requested size (0 : DSP_BUFFER_UNIT_SIZE), sub_cmd = alignment (0 : page)
+ *         dsp_buf_offset / alloc_size are returned (size rounded up to pages)
+ * free  : dsp_buf_offset of a buffer allocated through the same fd
+ */
 typedef struct {
     unsigned int dsp_buf_offset;   // Offset from DSP memory base address
     unsigned int alloc_size; // Size of the allocated buffer (if this is 0, the buffer is free)    
 } dxrt_dsp_buffer_metadata_t;
 
-// --- DSP Memory Manager Structure (assumed to be located at the beginning of shared memory region) ---
-typedef struct {
-    // Semaphore ID or pointer. Used to synchronize shared memory access between CPU and DSP.
-    // Can be a mutex or spinlock depending on the actual kernel environment.    
-    dxrt_dsp_buffer_metadata_t buffers[DSP_BUFFER_MAX_NUM];
-} dxrt_dsp_buffer_manager_t;
+/*
+ * DSP DRAM buffer, owned by the file which allocated it.
+ * Exported dma-bufs hold a reference, so the range is only returned to the pool
+ * once the owner has freed it and every importer has released it.
+ * A buffer still referenced when its device goes away is detached from the pool
+ * (mem NULL) and only freed by its last reference.
+ */
+struct dxrt_dram_pool;
+typedef struct dxrt_dram_buf {
+    struct kref ref;
+    struct dxrt_dram_pool *mem;     /* NULL once the pool is gone, under dxrt_dram_live_lock */
+    struct list_head live;          /* mem->live until destroyed, under dxrt_dram_live_lock */
+    struct list_head list;          /* owner->bufs */
+    struct dxrt_file_ctx *owner;
+    uint32_t offset;                /* from the DRAM window base */
+    uint32_t size;
+} dxrt_dram_buf_t;
+
+/* Allocator over the DSP DRAM window (gen_pool, page granularity) */
+typedef struct dxrt_dram_pool {
+    struct gen_pool *pool;
+    phys_addr_t base;
+    size_t size;
+    bool cacheable;                 /* the window can be mapped write-back */
+    struct mutex lock;              /* bufs and the owner lists */
+    struct xarray bufs;             /* dxrt_dram_buf_t indexed by offset >> PAGE_SHIFT */
+    struct list_head live;          /* every dxrt_dram_buf_t not destroyed yet, freed or not */
+    uint32_t num_bufs;
+    uint64_t alloc_count;
+    uint64_t alloc_fail;
+    uint64_t alloc_ns_total;        /* allocation latency */
+    uint64_t alloc_ns_max;
+} dxrt_dram_pool_t;
+
+#define DXRT_STAGING_MAX    16
+
+/* Staging buffers, [0] is dsp->dma_buf */
+typedef struct dxrt_staging_pool {
+    uint32_t num;
+    void *buf[DXRT_STAGING_MAX];
+    dma_addr_t addr[DXRT_STAGING_MAX];
+    size_t size[DXRT_STAGING_MAX];
+    struct dxrt_file_ctx *owner[DXRT_STAGING_MAX];  /* NULL : free, [0] is never owned */
+    spinlock_t lock;
+    wait_queue_head_t wq;           /* DX_STAGING_ACQUIRE waiting for a release */
+} dxrt_staging_pool_t;
 
-extern dxrt_dsp_buffer_manager_t g_dsp_memory_manager;
+typedef enum {
+    DXRT_HANDLE_DMABUF  = 0,
+    DXRT_HANDLE_USERPTR = 1,
+} dxrt_handle_type_t;
+
+/* Externally allocated buffer mapped for the DSP, owned by the file which imported it */
+typedef struct _dxrt_handle_t {
+    uint32_t type;                  /* dxrt_handle_type_t */
+    uint32_t size;
+    dma_addr_t dev_addr;            /* 0 if not contiguous for the DSP (userptr) */
+    struct sg_table *sgt;
+    struct dma_buf *dmabuf;         /* dmabuf */
+    struct dma_buf_attachment *attach;
+    struct page **pages;            /* userptr : pinned pages */
+    uint32_t npages;
+    enum dma_data_direction dir;
+    struct mm_struct *mm;           /* userptr : locked_vm accounting */
+} dxrt_handle_t;
 
 typedef struct
 {
@@ -198,6 +455,11 @@ typedef enum {
     DXRT_CMD_SET_DDR_FREQ       ,
     DXRT_CMD_ALLOC_DSP_BUF      ,
     DXRT_CMD_FREE_DSP_BUF       ,
+    DXRT_CMD_POLL_MODE          , /* Sub-command */
+    DXRT_CMD_DMABUF             , /* Sub-command */
+    DXRT_CMD_USERPTR            , /* Sub-command */
+    DXRT_CMD_MMAP_POPULATE      ,
+    DXRT_CMD_STAGING            , /* Sub-command */
     DXRT_CMD_MAX,
 } dxrt_cmd_t;
 
@@ -213,6 +475,46 @@ typedef enum {
     DX_SCHED_DELETE = 2
 } dxrt_sche_sub_cmd_t;
 
+/*
+ * Priority classes, DX_SCHED_PRIO_RT is dispatched first.
+ * Within a class the earliest deadline goes first, requests without a deadline in FIFO order.
+ */
+typedef enum {
+    DX_SCHED_PRIO_RT        = 0,    /* needs CAP_SYS_NICE */
+    DX_SCHED_PRIO_HIGH      = 1,
+    DX_SCHED_PRIO_NORMAL    = 2,    /* default */
+    DX_SCHED_PRIO_LOW       = 3,    /* background */
+    DX_SCHED_PRIO_NUM,
+} dxrt_sched_prio_t;
+
+/*
+ * Requests of the same class without deadline share the DSP time in proportion to
+ * the weight of their file (weighted fair queueing on the measured DSP time).
+ * The default weight comes from the cgroup of the opener (module param sched_cgroup_weights).
+ */
+#define DX_SCHED_WEIGHT_DEFAULT 100
+#define DX_SCHED_WEIGHT_MAX     10000
+
+/* DX_SCHED_ADD : applies to the requests submitted afterwards on this fd, DX_SCHED_DELETE restores the default */
+typedef struct _dxrt_sched_t {
+    uint32_t  prio;             /* dxrt_sched_prio_t */
+    uint32_t  deadline_us;      /* relative deadline of every request, 0 : none */
+    uint32_t  weight;           /* 1 .. DX_SCHED_WEIGHT_MAX, 0 : unchanged */
+    uint32_t  reserved;
+} dxrt_sched_t;//16B
+
+/* CMD : DXRT_CMD_DSP_RUN_REQ */
+typedef enum {
+    DX_BATCH_BLOCK      = 0,
+    DX_BATCH_NONBLOCK   = BIT(0),   /* -EAGAIN instead of waiting for ring space */
+} dxrt_batch_sub_cmd_t;
+
+/* CMD : DXRT_CMD_POLL_MODE */
+typedef enum {
+    DX_POLL_IRQ     = 0,    /* sleep until the completion IRQ (default) */
+    DX_POLL_HYBRID  = 1,    /* sleep for half of the expected time, then poll the mailbox */
+} dxrt_poll_sub_cmd_t;
+
 /* CMD : DXRT_CMD_DRV_INFO*/
 typedef enum {
     DRVINFO_CMD_GET_RT_INFO     = 0,
@@ -278,19 +580,89 @@ typedef struct {
     uint32_t     bar_magic;               /* 0x1C */
 } __attribute__ ((packed,aligned(4))) dx_download_msg;
 
-typedef struct dxrt_request_list
+struct dxrt_file_ctx;
+
+/* Request as queued in the driver */
+typedef struct dxrt_dsp_job
 {
-    struct list_head list;
     dxrt_dsp_request_t request;
-} dxrt_request_list_t;
-typedef struct dxrt_response_list
+    uint64_t submit_ns;
+    struct dxrt_file_ctx *ctx;  /* submitter, holds a reference until completion */
+    struct io_uring_cmd *ucmd;  /* io_uring command to complete, NULL for write()/ioctl */
+    uint64_t deadline_ns;       /* relative (0 : default of the file) until queued, then absolute, U64_MAX : none */
+    uint32_t prio;              /* dxrt_sched_prio_t of the file */
+    uint32_t seq;               /* submission order in the file, stamped when the slot is reserved */
+} dxrt_dsp_job_t;
+
+/*
+ * Submission ring : fixed-capacity MPSC ring of request slots.
+ * Producers (write) reserve a slot with a cmpxchg on head and publish it
+ * through the slot sequence. The request handler thread is the only consumer.
+ * There is one ring per CPU (dxrt_submit_queue_t), so producers on different
+ * CPUs do not share the head cacheline.
+ */
+typedef struct dxrt_request_slot
+{
+    atomic_t seq;
+    dxrt_dsp_job_t job;
+} dxrt_request_slot_t;
+typedef struct dxrt_request_ring
+{
+    uint32_t depth;     /* power of 2 */
+    uint32_t mask;
+    dxrt_request_slot_t *slots;
+    atomic_t head ____cacheline_aligned_in_smp;  /* producers */
+    uint32_t tail ____cacheline_aligned_in_smp;  /* consumer only */
+} dxrt_request_ring_t;
+
+/* Per-CPU submission rings of a device, drained round-robin by the dispatcher */
+typedef struct dxrt_submit_queue
+{
+    uint32_t nr;            /* nr_cpu_ids */
+    uint32_t depth;         /* of each ring */
+    dxrt_request_ring_t *rings;
+    uint32_t next;          /* dispatcher only : ring drained first next time */
+    atomic64_t full_count;  /* number of submits which found the ring of their CPU full */
+} dxrt_submit_queue_t;
+typedef struct dxrt_completion_ring
+{
+    dxrt_completion_ring_hdr_t *hdr;  /* vmalloc_user(), shared with user */
+    dxrt_completion_t *entries;
+    size_t size;
+    uint32_t mask;
+    spinlock_t lock;
+} dxrt_completion_ring_t;
+
+/* Request waiting in the dispatcher, moved out of the submission ring */
+typedef struct dxrt_sched_entry
 {
-    struct list_head list;
-    dxrt_response_t response;
-} dxrt_response_list_t;
+    struct list_head list;      /* sched->queue[prio] or sched->free */
+    uint32_t prio;              /* current class, raised by aging */
+    dxrt_dsp_job_t job;
+} dxrt_sched_entry_t;
+
+/*
+ * Class queues of the dispatcher, ordered by deadline.
+ * Entries are preallocated (one per submission ring slot).
+ */
+typedef struct dxrt_sched_queue
+{
+    spinlock_t lock;
+    struct list_head queue[DX_SCHED_PRIO_NUM];
+    struct list_head free;
+    dxrt_sched_entry_t *entries;
+    uint32_t queued[DX_SCHED_PRIO_NUM];
+    uint64_t vtime;             /* virtual time : vruntime of the last file served without deadline */
+    uint64_t aged_ns;           /* last aging pass */
+    uint64_t promoted;          /* requests raised one class by aging */
+    uint64_t late;              /* requests dispatched after their deadline */
+} dxrt_sched_queue_t;
 
 struct dxdev {
     int id;
+    struct kref ref;    /* driver + open files, see dxrt_dev_put() */
+    struct srcu_struct srcu;    /* file operations, waited for by remove_dxrt_device() */
+    bool dead;                  /* removed : file operations fail with -ENODEV, see dxrt_dev_enter() */
     struct cdev cdev;
     struct platform_device *pdev;
     struct device *dev;    
@@ -306,41 +678,180 @@ struct dxdev {
     uint32_t *log;
     dx_download_msg *dl;
 
-    //struct list_head sched;
-    //spinlock_t       sched_lock;
+    dxrt_sched_queue_t sched;
 
     struct task_struct *request_handler;
     wait_queue_head_t request_wq;
-    dxrt_request_list_t requests;
-    spinlock_t requests_lock;
-
-    dxrt_response_list_t responses;
-    spinlock_t responses_lock;
+    wait_queue_head_t request_space_wq;
+    dxrt_submit_queue_t requests;
+    struct mutex dispatch_lock; /* pick and run : request_handler, or a submitter (direct dispatch) */
+    uint64_t dispatch_count;    /* requests dispatched by request_handler */
+    uint64_t dispatch_cpu_ns;   /* cpu time of the request handlers stopped so far */
+    uint64_t direct_count;      /* requests dispatched by their submitter */
+    struct mutex tune_lock;     /* request_handler lifetime, and the settings below */
+    uint32_t dispatch_prio;     /* SCHED_FIFO priority of request_handler, 0 : SCHED_NORMAL */
+    cpumask_t dispatch_cpus;    /* cpus allowed for request_handler */
+    cpumask_t irq_cpus;         /* affinity hint of the DSP IRQ, empty : none */
+
+    struct list_head files;         /* open file contexts */
+    struct mutex files_lock;        /* files, remove_dxrt_device() unmaps them under it */
+    atomic64_t completion_overflow; /* completions dropped, all files */
+    atomic64_t poll_hit;            /* hybrid polls which found the completion */
+    atomic64_t poll_miss;           /* hybrid polls which fell back to the IRQ wait */
+    dxrt_dram_pool_t mem;           /* DSP DRAM allocator */
+    dxrt_staging_pool_t staging;    /* DXRT_CMD_WRITE_MEM / READ_MEM buffers */
 
-    dxrt_response_t response;
     wait_queue_head_t error_wq;
     dxrt_error_t error;
     dxrt_notify_throt_t notify;
     spinlock_t error_lock;
 };
 
+/* Per open file context : submission accounting, completion queue and poll state */
+struct dxrt_file_ctx {
+    struct kref ref;
+    struct dxdev *dx;
+    struct list_head list;          /* dx->files */
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+    dxrt_completion_ring_t completions;
+    dxrt_response_t response;       /* last response returned by read() */
+    wait_queue_head_t wq;
+    atomic_t event;                 /* completion or terminate, cleared by poll */
+    uint32_t poll_mode;             /* dxrt_poll_sub_cmd_t */
+    struct dxrt_driver *agg;        /* aggregate node : requests go to the least loaded device */
+    struct list_head bufs;          /* dxrt_dram_buf_t allocated by this file, freed on release */
+    struct xarray handles;          /* dxrt_handle_t imported by this file, freed on release */
+    struct mutex handle_lock;       /* handle release against sync / get_sg */
+    struct address_space *mapping;  /* of the file, to drop the mappings of freed buffers */
+    uint32_t sched_prio;            /* DX_SCHED_ADD, DX_SCHED_PRIO_NORMAL by default */
+    uint32_t sched_deadline_us;
+    uint32_t sched_weight;          /* DX_SCHED_ADD, sched_cgroup_weight by default */
+    uint32_t sched_cgroup_weight;   /* of the cgroup of the opener */
+    uint64_t cgroup_id;             /* cgroup v2 of the opener, 0 if unknown */
+    bool sched_set;
+    atomic64_t sched_vruntime;      /* DSP time / weight, ns at DX_SCHED_WEIGHT_DEFAULT */
+    atomic64_t dsp_ns;              /* DSP time used by the requests of this file */
+    atomic_t sched_seq;             /* next dxrt_dsp_job_t.seq */
+    uint32_t sched_next;            /* next seq to dispatch, under ctx->dx->dispatch_lock */
+    atomic64_t submitted;
+    atomic64_t completed;
+};
+
+#define DXRT_AGGREGATE_MINOR    DX_DEVICE_MAX_NUM
+
 struct dxrt_driver {
     dev_t dev_num;
     struct class *dev_class;
+    struct mutex lock;              /* devices[] updates (probe / remove), readers use RCU */
     int num_devices;
-    struct dxdev *devices[DX_DEVICE_MAX_NUM];
-    struct platform_device *pdev;
+    struct dxdev __rcu *devices[DX_DEVICE_MAX_NUM];   /* indexed by device id, NULL if not probed */
+    struct cdev agg_cdev;           /* aggregate node, module param 'aggregate' */
+    struct device *agg_dev;
+    atomic_t agg_next;
 };
 
-typedef int (*dxrt_message_handler)(struct dxdev*, dxrt_message_t*);
+typedef int (*dxrt_message_handler)(struct dxdev*, dxrt_message_t*, struct dxrt_file_ctx*);
 
 int dxrt_dsp_driver_cdev_init(struct dxrt_driver *drv);
 void dxrt_dsp_driver_cdev_deinit(struct dxrt_driver *drv);
+struct dxdev *dxrt_dsp_driver_add_device(struct dxrt_driver *drv, struct platform_device *pdev);
+void dxrt_dsp_driver_remove_device(struct dxrt_driver *drv, struct dxdev *dx);
+struct dxdev *dxrt_aggregate_pick(struct dxrt_driver *drv);
+struct dxdev *dxrt_dev_get(struct dxdev *dx);
+void dxrt_dev_put(struct dxdev *dx);
+int dxrt_dev_enter(struct dxdev *dx);
+void dxrt_dev_exit(struct dxdev *dx, int idx);
 int dxrt_request_handler(void *data);
-int dxrt_is_request_list_empty(dxrt_request_list_t *requests, spinlock_t *lock);
-int message_handler_general(struct dxdev *dx, dxrt_message_t *msg);
+bool dxrt_dispatch_direct(struct dxdev *dx, dxrt_dsp_job_t *job);
+void dxrt_dispatch_start(struct dxdev *dx);
+void dxrt_dispatch_stop(struct dxdev *dx);
+int dxrt_dispatch_set_prio(struct dxdev *dx, uint32_t prio);
+int dxrt_dispatch_set_cpus(struct dxdev *dx, const struct cpumask *mask);
+int dxrt_dispatch_set_irq_cpus(struct dxdev *dx, const struct cpumask *mask);
+void dxrt_dsp_job_fail(dxrt_dsp_job_t *job, int err);
+struct dxrt_file_ctx *dxrt_file_ctx_get(struct dxrt_file_ctx *ctx);
+void dxrt_file_ctx_put(struct dxrt_file_ctx *ctx);
+void dxrt_file_ctx_complete(struct dxrt_file_ctx *ctx, const dxrt_completion_t *comp);
+void dxrt_job_complete(struct dxrt_file_ctx *ctx, struct io_uring_cmd *ucmd, const dxrt_completion_t *comp);
+int dxrt_submit_jobs(struct dxrt_file_ctx *ctx, dxrt_dsp_job_t *jobs, uint32_t num, bool nonblock);
+int dxrt_sched_init(dxrt_sched_queue_t *q, uint32_t num);
+void dxrt_sched_deinit(dxrt_sched_queue_t *q);
+void dxrt_sched_fetch(struct dxdev *dx);
+dxrt_sched_entry_t *dxrt_sched_pick(struct dxdev *dx);
+void dxrt_sched_put(dxrt_sched_queue_t *q, dxrt_sched_entry_t *e);
+void dxrt_sched_cancel(struct dxdev *dx);
+uint32_t dxrt_sched_count(dxrt_sched_queue_t *q);
+void dxrt_sched_ctx_init(struct dxrt_file_ctx *ctx);
+void dxrt_sched_charge(struct dxrt_file_ctx *ctx, uint64_t exec_ns);
+ssize_t dxrt_sched_utilization_show(struct dxdev *dx, char *buf);
+ssize_t dxrt_sched_show(dxrt_sched_queue_t *q, char *buf);
+int dxrt_request_ring_init(dxrt_request_ring_t *ring, uint32_t depth);
+void dxrt_request_ring_deinit(dxrt_request_ring_t *ring);
+int dxrt_request_ring_push(dxrt_request_ring_t *ring, const dxrt_dsp_job_t *job);
+int dxrt_request_ring_push_batch(dxrt_request_ring_t *ring, const dxrt_dsp_job_t *jobs, uint32_t num,
+    atomic_t *seq);
+dxrt_dsp_job_t *dxrt_request_ring_peek(dxrt_request_ring_t *ring);
+void dxrt_request_ring_pop(dxrt_request_ring_t *ring);
+int dxrt_request_ring_empty(dxrt_request_ring_t *ring);
+uint32_t dxrt_request_ring_count(dxrt_request_ring_t *ring);
+int dxrt_submit_queue_init(dxrt_submit_queue_t *q, uint32_t depth);
+void dxrt_submit_queue_deinit(dxrt_submit_queue_t *q);
+int dxrt_submit_queue_push(dxrt_submit_queue_t *q, const dxrt_dsp_job_t *jobs, uint32_t num, atomic_t *seq);
+int dxrt_submit_queue_empty(dxrt_submit_queue_t *q);
+uint32_t dxrt_submit_queue_count(dxrt_submit_queue_t *q);
+int dxrt_completion_ring_init(dxrt_completion_ring_t *ring, uint32_t depth);
+void dxrt_completion_ring_deinit(dxrt_completion_ring_t *ring);
+int dxrt_completion_ring_push(dxrt_completion_ring_t *ring, const dxrt_completion_t *comp);
+int dxrt_completion_ring_pop(dxrt_completion_ring_t *ring, dxrt_completion_t *comp);
+int dxrt_completion_ring_empty(dxrt_completion_ring_t *ring);
+void dxrt_completion_ring_reset(dxrt_completion_ring_t *ring);
+int message_handler_general(struct dxdev *dx, dxrt_message_t *msg, struct dxrt_file_ctx *ctx);
+int dxrt_dram_pool_init(dxrt_dram_pool_t *mem, phys_addr_t base, size_t size);
+void dxrt_dram_pool_deinit(dxrt_dram_pool_t *mem);
+int dxrt_dram_alloc(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx, uint32_t size, uint32_t align,
+    dxrt_dsp_buffer_metadata_t *meta);
+int dxrt_dram_free(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx, uint32_t offset);
+dxrt_dram_buf_t *dxrt_dram_buf_get(dxrt_dram_pool_t *mem, uint32_t offset);
+void dxrt_dram_buf_put(dxrt_dram_buf_t *b);
+int dxrt_dmabuf_export(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_dmabuf_t *arg);
+int dxrt_dmabuf_import(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_dmabuf_t *arg);
+int dxrt_handle_release(struct dxdev *dx, struct dxrt_file_ctx *ctx, uint32_t handle);
+int dxrt_sgt_dev_addr(struct sg_table *sgt, dma_addr_t *addr, size_t *size);
+#ifdef DXRT_HAS_USERPTR
+int dxrt_userptr_register(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_userptr_t *arg);
+int dxrt_userptr_get_sg(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_userptr_t *arg);
+int dxrt_userptr_sync(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_userptr_t *arg);
+void dxrt_userptr_unmap(struct dxdev *dx, dxrt_handle_t *h);
+#endif
+void dxrt_handle_release_ctx(struct dxdev *dx, struct dxrt_file_ctx *ctx);
+void dxrt_dram_release_ctx(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx);
+ssize_t dxrt_dram_pool_show(dxrt_dram_pool_t *mem, char *buf);
+int dxrt_dram_cache_sync(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx, uint32_t offset, uint32_t size,
+    uint32_t op);
+ssize_t dxrt_dram_upload_bench(dxrt_dram_pool_t *mem, char *buf);
+int dxrt_vma_mmap(struct dxrt_file_ctx *ctx, struct vm_area_struct *vma, phys_addr_t base, size_t size,
+    bool dram);
+void dxrt_dram_zap(struct dxrt_file_ctx *ctx, phys_addr_t addr, size_t size);
+bool dxrt_dram_owned(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx, uint64_t offset, uint64_t size);
+int dxrt_dram_populate(struct dxrt_file_ctx *ctx, unsigned long start, unsigned long len);
+unsigned long dxrt_dev_get_unmapped_area(struct file *f, unsigned long addr, unsigned long len,
+    unsigned long pgoff, unsigned long flags);
+#ifdef DXRT_HAS_URING_CMD
+int dxrt_dev_uring_cmd(struct io_uring_cmd *ucmd, unsigned int issue_flags);
+void dxrt_uring_cmd_complete(struct io_uring_cmd *ucmd, const dxrt_completion_t *comp);
+#else
+static inline void dxrt_uring_cmd_complete(struct io_uring_cmd *ucmd, const dxrt_completion_t *comp) {}
+#endif
+int dxrt_staging_init(struct dxdev *dx);
+void dxrt_staging_deinit(struct dxdev *dx);
+int dxrt_staging_acquire(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_staging_t *arg);
+int dxrt_staging_release(struct dxdev *dx, struct dxrt_file_ctx *ctx, uint32_t ch);
+void dxrt_staging_release_ctx(struct dxdev *dx, struct dxrt_file_ctx *ctx);
+void *dxrt_staging_buf(struct dxdev *dx, struct dxrt_file_ctx *ctx, uint32_t ch, uint64_t offset, uint64_t size);
 void dxrt_device_init(struct dxdev* dev);
 
 extern dxrt_message_handler message_handler[];
+extern const struct attribute_group *dxrt_dev_groups[];
 
 #endif // __DXRT_DRV_H
@@ -13,6 +13,7 @@
 #include <linux/interrupt.h>
 #include <linux/dma-mapping.h>
 #include "dxrt_drv_common.h"
+#include "dsp_reg_DX_V3.h"
 
 //#include "npu_reg_sys_DX_V3.h"
 //#include "npu_reg_dma_DX_V3.h"
@@ -22,7 +23,20 @@
 //typedef dxDMA_t dsp_reg_dma_t;
 
 struct dxdev;
-struct _dxrt_response_t;
+struct dxrt_file_ctx;
+struct io_uring_cmd;
+/* request owned by the DSP, indexed by message slot (req_id) */
+#define DSP_EXEC_EST_NUM    (64)    /* execution time history, indexed by func_id */
+
+struct dxdsp_inflight {
+    struct dxrt_file_ctx *ctx;
+    struct io_uring_cmd *ucmd;
+    uint32_t req_id;
+    uint16_t func_id;
+    uint64_t submit_ns;
+    uint64_t dispatch_ns;
+    uint64_t exec_ns;       /* DSP busy time charged to the file on completion */
+};
 struct dxdsp {
     int id;
     struct dxdev *dx;
@@ -42,7 +56,6 @@ struct dxdsp {
     volatile void __iomem *reg_dsp_base_debug;
     volatile void __iomem *reg_dsp_base_mailbox;
     volatile void __iomem *reg_dsp_base_sram;    
-    volatile void __iomem *reg_dsp_base_dram;
     //dsp_reg_sys_t *reg_sys;
     //dsp_reg_dma_t *reg_dma;
     //dsp_reg_sys_t *reg_dsp_sys;
@@ -56,6 +69,18 @@ struct dxdsp {
     size_t dma_buf_size;
     void *dma_buf;
     uint32_t req_id;
+    /* pipelined dispatch : up to 'pipeline_depth' message slots in flight */
+    uint32_t pipeline_depth;
+    uint32_t credits;
+    unsigned long inflight;                 /* bitmap of slots owned by the DSP */
+    uint32_t inflight_fifo[DSP_MSG_SLOT_NUM]; /* slots written to SRAM, in dispatch order */
+    struct dxdsp_inflight inflight_req[DSP_MSG_SLOT_NUM];
+    uint32_t inflight_num;
+    spinlock_t inflight_lock;
+    wait_queue_head_t credit_wq;
+    /* hybrid polling : EWMA of the DSP execution time per func_id */
+    uint64_t exec_est_ns[DSP_EXEC_EST_NUM];
+    uint64_t last_done_ns;  /* last completion, start of the next busy period */
     int irq_num;    
     int irq_event;
     // spinlock_t status_lock;
@@ -64,10 +89,13 @@ struct dxdsp {
     wait_queue_head_t irq_wq;
     //struct mutex run_lock;
     uint32_t default_values[3];
-    struct _dxrt_response_t *response;
     int (*init)(struct dxdsp*);
     int (*prepare_inference)(struct dxdsp*);
     int (*run)(struct dxdsp*, void *);
+    int (*try_run)(struct dxdsp*, void *);  /* -EBUSY instead of waiting for a slot */
+    int (*wait_credit)(struct dxdsp*);      /* until a message can be sent, before picking it */
+    int (*poll)(struct dxdsp*);
+    int64_t (*poll_delay)(struct dxdsp*, struct dxrt_file_ctx*);
     int (*reg_dump)(struct dxdsp*);
     int (*deinit)(struct dxdsp*);
 };
@@ -80,6 +108,10 @@ struct dxdsp_cfg {
     int (*init)(struct dxdsp*);
     int (*prepare_inference)(struct dxdsp*);
     int (*run)(struct dxdsp*, void *);
+    int (*try_run)(struct dxdsp*, void *);
+    int (*wait_credit)(struct dxdsp*);
+    int (*poll)(struct dxdsp*);
+    int64_t (*poll_delay)(struct dxdsp*, struct dxrt_file_ctx*);
     int (*reg_dump)(struct dxdsp*);
     int (*deinit)(struct dxdsp*);
 };
@@ -92,6 +124,10 @@ int dx_v3_dsp_init(dxdsp_t *dsp);
 int dx_v3_dsp_reset_and_start(dxdsp_t *dsp);
 int dx_v3_dsp_prepare_inference(dxdsp_t *dsp);
 int dx_v3_dsp_run(dxdsp_t *dsp, void*);
+int dx_v3_dsp_try_run(dxdsp_t *dsp, void*);
+int dx_v3_dsp_wait_credit(dxdsp_t *dsp);
+int dx_v3_dsp_poll(dxdsp_t *dsp);
+int64_t dx_v3_dsp_poll_delay(dxdsp_t *dsp, struct dxrt_file_ctx *ctx);
 int dx_v3_dsp_reg_dump(dxdsp_t *dsp);
 int dx_v3_dsp_deinit(dxdsp_t *dsp);
 #endif // __DXRT_DRV_DSP_H
@@ -34,28 +34,34 @@
 
 static struct dxrt_driver drv;
 
+/* One probe per DSP node, each with its own registers, mailbox IRQ and SRAM */
 static int dxrt_dsp_driver_probe(struct platform_device *pdev)
 {
-	int ret = 0;
-    pr_debug( "%s\n", __func__);
-
-	platform_set_drvdata(pdev, &drv);
-	drv.pdev = pdev;
+    struct dxdev *dx;
+    pr_debug( "%s: %pOF\n", __func__, pdev->dev.of_node);
 
-    ret = dxrt_dsp_driver_cdev_init(&drv);
-    pr_info( "%s done: %d\n", __func__, ret);
-    return ret;
+    dx = dxrt_dsp_driver_add_device(&drv, pdev);
+    if (IS_ERR(dx))
+        return PTR_ERR(dx);
+	platform_set_drvdata(pdev, dx);
+    pr_info( "%s done: %s%d\n", __func__, MODULE_NAME, dx->id);
+    return 0;
 }
 static int dxrt_dsp_driver_remove(struct platform_device *pdev)
 {
+    struct dxdev *dx = platform_get_drvdata(pdev);
     pr_debug( "%s\n", __func__);
-    dxrt_dsp_driver_cdev_deinit(&drv);
+    dxrt_dsp_driver_remove_device(&drv, dx);
     pr_info( "%s done.\n", __func__);
     return 0;
 }
 
 static const struct of_device_id deepx_dsp_of_match[] = {
 	{ .compatible = "deepx,dsp0" },	
+	{ .compatible = "deepx,dsp1" },	
+	{ .compatible = "deepx,dsp2" },	
+	{ .compatible = "deepx,dsp3" },	
+	{ .compatible = "deepx,dsp" },	
 	{ },
 };
 
@@ -70,7 +76,26 @@ static struct platform_driver dxrt_drv = {
 		.of_match_table = deepx_dsp_of_match,
 	},
 };
-module_platform_driver(dxrt_drv);
+
+static int __init dxrt_dsp_driver_init(void)
+{
+    int ret;
+
+    ret = dxrt_dsp_driver_cdev_init(&drv);
+    if (ret)
+        return ret;
+    ret = platform_driver_register(&dxrt_drv);
+    if (ret)
+        dxrt_dsp_driver_cdev_deinit(&drv);
+    return ret;
+}
+static void __exit dxrt_dsp_driver_exit(void)
+{
+    platform_driver_unregister(&dxrt_drv);
+    dxrt_dsp_driver_cdev_deinit(&drv);
+}
+module_init(dxrt_dsp_driver_init);
+module_exit(dxrt_dsp_driver_exit);
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Taegyun An <atg@deepx.ai>");
@@ -22,6 +22,12 @@
 #include <linux/delay.h>
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/of.h>
+#include <linux/platform_device.h>
 
 #if DEVICE_TYPE==1
 /* L2 cache flush api */
@@ -32,27 +38,181 @@
 
 static const u64 dmamask = DMA_BIT_MASK(32);
 
+static unsigned int request_ring_depth = DXRT_REQUEST_RING_DEPTH_DEFAULT;
+module_param(request_ring_depth, uint, 0444);
+MODULE_PARM_DESC(request_ring_depth, "Submission ring depth per device and CPU (rounded up to a power of 2)");
+
+static unsigned int completion_ring_depth = DXRT_COMPLETION_RING_DEPTH_DEFAULT;
+module_param(completion_ring_depth, uint, 0444);
+MODULE_PARM_DESC(completion_ring_depth, "Completion ring depth per open file (rounded up to a power of 2)");
+
+/*
+ * The device is freed with its last reference : the driver drops its own in
+ * remove_dxrt_device(), every file context holds one until it is freed.
+ * The DSP, the pools and the queues are torn down at remove, only the structure,
+ * its class device (still used to unmap what files imported) and its SRCU stay.
+ */
+static void dxrt_dev_free(struct kref *ref)
+{
+    struct dxdev *dx = container_of(ref, struct dxdev, ref);
+
+    put_device(dx->dev);
+    cleanup_srcu_struct(&dx->srcu);
+    kfree(dx);
+}
+struct dxdev *dxrt_dev_get(struct dxdev *dx)
+{
+    kref_get(&dx->ref);
+    return dx;
+}
+void dxrt_dev_put(struct dxdev *dx)
+{
+    kref_put(&dx->ref, dxrt_dev_free);
+}
+
+/*
+ * File operations which use the DSP, the pools or the queues run between
+ * dxrt_dev_enter() and dxrt_dev_exit() : remove_dxrt_device() marks the device
+ * dead, then waits for them before the teardown. Returns the SRCU index, or -ENODEV.
+ */
+int dxrt_dev_enter(struct dxdev *dx)
+{
+    int idx = srcu_read_lock(&dx->srcu);
+
+    if (READ_ONCE(dx->dead))
+    {
+        srcu_read_unlock(&dx->srcu, idx);
+        return -ENODEV;
+    }
+    return idx;
+}
+void dxrt_dev_exit(struct dxdev *dx, int idx)
+{
+    srcu_read_unlock(&dx->srcu, idx);
+}
+
+static void dxrt_file_ctx_free(struct kref *ref)
+{
+    struct dxrt_file_ctx *ctx = container_of(ref, struct dxrt_file_ctx, ref);
+    dxrt_completion_ring_deinit(&ctx->completions);
+    dxrt_dev_put(ctx->dx);
+    kfree(ctx);
+}
+struct dxrt_file_ctx *dxrt_file_ctx_get(struct dxrt_file_ctx *ctx)
+{
+    kref_get(&ctx->ref);
+    return ctx;
+}
+void dxrt_file_ctx_put(struct dxrt_file_ctx *ctx)
+{
+    kref_put(&ctx->ref, dxrt_file_ctx_free);
+}
+
+/*
+ * Deliver a completion to the file which submitted the request,
+ * and drop the reference taken for that request. Callable from IRQ context.
+ */
+void dxrt_file_ctx_complete(struct dxrt_file_ctx *ctx, const dxrt_completion_t *comp)
+{
+    if (dxrt_completion_ring_push(&ctx->completions, comp))
+        atomic64_inc(&ctx->dx->completion_overflow);
+    atomic64_inc(&ctx->completed);
+    atomic_set(&ctx->event, 1);
+    wake_up_interruptible(&ctx->wq);
+    dxrt_file_ctx_put(ctx);
+}
+
+/* Requests submitted by io_uring complete with a CQE, the others on the file's completion ring */
+void dxrt_job_complete(struct dxrt_file_ctx *ctx, struct io_uring_cmd *ucmd, const dxrt_completion_t *comp)
+{
+    if (ucmd)
+    {
+        dxrt_uring_cmd_complete(ucmd, comp);
+        atomic64_inc(&ctx->completed);
+        dxrt_file_ctx_put(ctx);
+        return;
+    }
+    dxrt_file_ctx_complete(ctx, comp);
+}
+
+static int dxrt_dev_open_ctx(struct dxdev *dx, struct file *f)
+{
+    struct dxrt_file_ctx *ctx;
+    int idx;
+
+    idx = dxrt_dev_enter(dx);
+    if (idx < 0)
+        return idx;
+    ctx = kzalloc(sizeof(struct dxrt_file_ctx), GFP_KERNEL);
+    if (!ctx)
+    {
+        dxrt_dev_exit(dx, idx);
+        return -ENOMEM;
+    }
+    if (dxrt_completion_ring_init(&ctx->completions, completion_ring_depth) < 0)
+    {
+        kfree(ctx);
+        dxrt_dev_exit(dx, idx);
+        return -ENOMEM;
+    }
+    kref_init(&ctx->ref);
+    INIT_LIST_HEAD(&ctx->bufs);
+    xa_init_flags(&ctx->handles, XA_FLAGS_ALLOC1);
+    mutex_init(&ctx->handle_lock);
+    ctx->mapping = f->f_mapping;
+    dxrt_sched_ctx_init(ctx);
+    ctx->dx = dxrt_dev_get(dx);
+    ctx->pid = task_tgid_nr(current);
+    get_task_comm(ctx->comm, current);
+    init_waitqueue_head(&ctx->wq);
+    atomic_set(&ctx->event, 0);
+    atomic64_set(&ctx->submitted, 0);
+    atomic64_set(&ctx->completed, 0);
+
+    mutex_lock(&dx->files_lock);
+    list_add_tail(&ctx->list, &dx->files);
+    mutex_unlock(&dx->files_lock);
+    dxrt_dev_exit(dx, idx);
+
+    f->private_data = ctx;
+    return 0;
+}
 static int dxrt_dev_open(struct inode *i, struct file *f)
 {
     struct dxdev *dx;
     //int num = iminor(f->f_inode);
     pr_debug( "%s: %s\n", f->f_path.dentry->d_iname, __func__);
     dx = container_of(i->i_cdev, struct dxdev, cdev);
-    f->private_data = dx;
-
-    dx->response.req_id = 0;
-    dx->dsp->irq_event = 0;
-    return 0;
+    return dxrt_dev_open_ctx(dx, f);
 }
 static int dxrt_dev_release(struct inode *i, struct file *f)
 {    
+    struct dxrt_file_ctx *ctx = f->private_data;
+    struct dxdev *dx = ctx->dx;
+    int idx;
     pr_debug( "%s: %s\n", f->f_path.dentry->d_iname, __func__);
 
+    mutex_lock(&dx->files_lock);
+    list_del(&ctx->list);
+    mutex_unlock(&dx->files_lock);
+    /* after remove, the DRAM buffers and the staging buffers are gone already */
+    idx = dxrt_dev_enter(dx);
+    if (idx >= 0)
+    {
+        dxrt_dram_release_ctx(&dx->mem, ctx);
+        dxrt_staging_release_ctx(dx, ctx);
+        dxrt_dev_exit(dx, idx);
+    }
+    dxrt_handle_release_ctx(dx, ctx);
+    /* requests still queued or running keep the context until they complete */
+    dxrt_file_ctx_put(ctx);
     return 0;
 }
+/* Returns the oldest unread completion of this file, or the last one again if none is pending */
 static ssize_t dxrt_dev_read(struct file *f, char __user *buf, size_t len, loff_t *off)
 {
-    struct dxdev *dx = f->private_data;
+    struct dxrt_file_ctx *ctx = f->private_data;
+    dxrt_completion_t comp;
     pr_debug( "%s: %s\n", f->f_path.dentry->d_iname, __func__);
 
     if (len < sizeof(dxrt_response_t)) {
@@ -61,79 +221,217 @@ static ssize_t dxrt_dev_read(struct file *f, char __user *buf, size_t len, loff_
         return -EINVAL;
     }
 
-    if(copy_to_user(buf, &dx->response, sizeof(dxrt_response_t))) {
+    if (dxrt_completion_ring_pop(&ctx->completions, &comp) == 0)
+        ctx->response = comp.response;
+    if(copy_to_user(buf, &ctx->response, sizeof(dxrt_response_t))) {
         pr_err( "%s: failed to copy response\n", f->f_path.dentry->d_iname);
         return -EFAULT;
     }
 
     return sizeof(dxrt_response_t);
 }
+/**
+ * dxrt_submit_jobs - Queue requests of one file to the dispatcher
+ * @ctx: The file context which owns the requests
+ * @jobs: Requests to queue, submit_ns, ctx and prio are filled here,
+ *        deadline_ns is relative (0 : the deadline of DX_SCHED_ADD)
+ * @num: Number of requests
+ * @nonblock: Fail with -EAGAIN instead of waiting for ring space
+ *
+ * The requests are queued together (never interleaved with other files)
+ * and the dispatcher is woken up once. A single request to an idle device
+ * is written to the DSP directly (dxrt_dispatch_direct()).
+ *
+ * Return: 0 on success,
+ *        -ENODEV   if the device is removed or has no request handler running
+ *        -E2BIG    if the batch is larger than the request ring
+ *        -EAGAIN   if the ring is full and @nonblock is set
+ *        -ERESTARTSYS if interrupted while waiting for ring space
+ */
+int dxrt_submit_jobs(struct dxrt_file_ctx *ctx, dxrt_dsp_job_t *jobs, uint32_t num, bool nonblock)
+{
+    struct dxdev *dx = ctx->agg ? dxrt_aggregate_pick(ctx->agg) : ctx->dx;
+    uint64_t now = ktime_get_ns();
+    uint64_t deadline_ns = (uint64_t)READ_ONCE(ctx->sched_deadline_us) * NSEC_PER_USEC;
+    uint32_t prio = READ_ONCE(ctx->sched_prio);
+    uint32_t i;
+    int ret, idx;
+
+    if (!dx)
+        return -ENODEV;
+    /* the target of an aggregate file may not be the device of the file */
+    idx = dxrt_dev_enter(dx);
+    if (idx < 0)
+    {
+        ret = idx;
+        goto out_put;
+    }
+    /* nobody would drain the rings : the request handler failed to start or is stopped */
+    if (!READ_ONCE(dx->request_handler))
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+    if (num > dx->requests.depth)
+    {
+        ret = -E2BIG;
+        goto out;
+    }
+    for (i = 0; i < num; i++)
+    {
+        jobs[i].submit_ns = now;
+        jobs[i].ctx = dxrt_file_ctx_get(ctx);
+        jobs[i].prio = prio;
+        if (!jobs[i].deadline_ns)
+            jobs[i].deadline_ns = deadline_ns;
+        jobs[i].deadline_ns = jobs[i].deadline_ns ? now + jobs[i].deadline_ns : U64_MAX;
+    }
+    if (num == 1 && dxrt_dispatch_direct(dx, jobs))
+    {
+        atomic64_inc(&ctx->submitted);
+        ret = 0;
+        goto out;
+    }
+    ret = dxrt_submit_queue_push(&dx->requests, jobs, num, &ctx->sched_seq);
+    if (ret == -ENOSPC)
+    {
+        atomic64_inc(&dx->requests.full_count);
+        if (nonblock)
+            ret = -EAGAIN;
+        else
+        {
+            int push = -ENOSPC;
+
+            /* woken up by remove_dxrt_device() too, which waits for this submit to return */
+            ret = wait_event_interruptible(dx->request_space_wq,
+                (push = dxrt_submit_queue_push(&dx->requests, jobs, num, &ctx->sched_seq)) != -ENOSPC ||
+                READ_ONCE(dx->dead));
+            if (ret == 0)
+                ret = push == -ENOSPC ? -ENODEV : push;
+        }
+    }
+    if (ret)
+    {
+        for (i = 0; i < num; i++)
+            dxrt_file_ctx_put(ctx);
+        goto out;
+    }
+    atomic64_add(num, &ctx->submitted);
+    wake_up_interruptible(&dx->request_wq);
+out:
+    dxrt_dev_exit(dx, idx);
+out_put:
+    /* aggregate : reference taken by dxrt_aggregate_pick() */
+    if (ctx->agg)
+        dxrt_dev_put(dx);
+    return ret;
+}
+
+/* Accepts one dxrt_dsp_request_t or an array of up to DXRT_REQUEST_BATCH_MAX */
 static ssize_t dxrt_dev_write(struct file *f, const char __user *buf, size_t len, loff_t *off)
 {
-    // unsigned long flags;
-    struct dxdev *dx = f->private_data;
+    struct dxrt_file_ctx *ctx = f->private_data;
+    struct dxdev *dx = ctx->dx;
     pr_debug( "%s: %s\n", f->f_path.dentry->d_iname, __func__);
     if(dx->request_handler)
     {
-        dxrt_request_list_t *entry;
-        entry = kmalloc(sizeof(dxrt_request_list_t), GFP_KERNEL);
-        if(!entry)
-        {
-            printk(KERN_ALERT "Failed to allocate memory for request queue entry\n");
-            return -ENOMEM;
-        }    
-        if (len != sizeof(dxrt_dsp_request_t)) {
-            printk(KERN_ALERT "Invalid request size: %lu\n", len);
-            kfree(entry);
+        dxrt_dsp_job_t single, *jobs = &single;
+        size_t num = len / sizeof(dxrt_dsp_request_t);
+        size_t i;
+        int ret = 0;
+        if (num == 0 || num > DXRT_REQUEST_BATCH_MAX || len % sizeof(dxrt_dsp_request_t)) {
+            pr_debug("%d: %s: invalid request size %zu\n", dx->id, __func__, len);
             return -EINVAL;
         }
-        if (copy_from_user(&(entry->request), buf, len)) {
-            printk(KERN_ALERT "Failed to copy request data from user space\n");
-            kfree(entry);
-            return -EFAULT;
-        }        
-        spin_lock(&dx->requests_lock);
-        list_add_tail(&entry->list, &dx->requests.list);
-        spin_unlock(&dx->requests_lock);
-        // {
-        //     dxrt_dsp_request_t *req = &entry->request;
-        //     pr_debug( MODULE_NAME "%d: %s: req %d\n", 
-        //         num, __func__, req->req_id);
-        // }
-        wake_up_interruptible(&dx->request_wq);
-        return len;
+        if (num > 1) {
+            jobs = kmalloc_array(num, sizeof(dxrt_dsp_job_t), GFP_KERNEL);
+            if (!jobs)
+                return -ENOMEM;
+        }
+        for (i = 0; i < num; i++)
+        {
+            if (copy_from_user(&jobs[i].request, buf + i * sizeof(dxrt_dsp_request_t), sizeof(dxrt_dsp_request_t))) {
+                pr_debug("%d: %s: failed to copy request %zu\n", dx->id, __func__, i);
+                ret = -EFAULT;
+                break;
+            }
+            if (jobs[i].request.req_id >= DSP_MSG_SLOT_NUM ||
+                jobs[i].request.msg_header.message_size > sizeof(jobs[i].request.msg_data)) {
+                pr_debug("%d: %s: invalid request id %u (size %u)\n", dx->id, __func__,
+                    jobs[i].request.req_id, jobs[i].request.msg_header.message_size);
+                ret = -EINVAL;
+                break;
+            }
+            jobs[i].ucmd = NULL;
+            jobs[i].deadline_ns = 0;
+        }
+        if (ret == 0)
+            ret = dxrt_submit_jobs(ctx, jobs, num, f->f_flags & O_NONBLOCK);
+        if (jobs != &single)
+            kfree(jobs);
+        return ret ? ret : len;
     }
     return 0;
 }
 static int dxrt_dev_mmap(struct file *f, struct vm_area_struct *vma)
 {
     int ret = -1;
-    struct dxdev *dx = f->private_data;
+    struct dxrt_file_ctx *ctx = f->private_data;
+    struct dxdev *dx = ctx->dx;
     pr_debug( "%s: %s\n", f->f_path.dentry->d_iname, __func__);
     
+    int idx = dxrt_dev_enter(dx);
+    if (idx < 0)
+        return idx;
     struct dxdsp *dsp = dx->dsp;
     unsigned long size = vma->vm_end - vma->vm_start;
     
-    if (vma->vm_pgoff == 0)// Memory mapping for DRAM
+    if (vma->vm_pgoff == DXRT_MMAP_DRAM)// Memory mapping for DRAM, filled on fault
     {        
-        unsigned long pfn = dsp->reg_dsp_base_phy_addr_dram >> PAGE_SHIFT;        
 #if 1//use non-cached area
         vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 #endif        
-        ret = remap_pfn_range(vma, vma->vm_start, pfn, size, vma->vm_page_prot);    
+        ret = dxrt_vma_mmap(ctx, vma, dx->mem.base, dx->mem.size, true);
+    }
+    else if (vma->vm_pgoff == DXRT_MMAP_DRAM_CACHED)// Memory mapping for DRAM, cacheable
+    {
+        /* without the kernel alias the user could not sync the mapping */
+        if (!dx->mem.cacheable)
+        {
+            pr_info_once(MODULE_NAME "%d: DXRT_MMAP_DRAM_CACHED is unavailable, no cacheable alias of the DRAM\n", dx->id);
+            ret = -EINVAL;
+        }
+        else
+            ret = dxrt_vma_mmap(ctx, vma, dx->mem.base, dx->mem.size, true);
+    }
+    else if (vma->vm_pgoff == DXRT_MMAP_DRAM_WC)// Memory mapping for DRAM, write-combining
+    {
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+        ret = dxrt_vma_mmap(ctx, vma, dx->mem.base, dx->mem.size, true);
     }
-    else if (vma->vm_pgoff == 1)// Memory mapping for SRAM
+    else if (vma->vm_pgoff == DXRT_MMAP_SRAM)// Memory mapping for SRAM, filled on fault
     {        
-        unsigned long pfn = dsp->reg_dsp_base_phy_addr_sram >> PAGE_SHIFT;
         vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-        ret = remap_pfn_range(vma, vma->vm_start, pfn, size, vma->vm_page_prot);
+        ret = dxrt_vma_mmap(ctx, vma, dsp->reg_dsp_base_phy_addr_sram, DSP_SRAM_SIZE, false);
+    }
+    else if (vma->vm_pgoff == DXRT_MMAP_SRAM_WC)// Write-combining, for CPU writes only
+    {
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+        ret = dxrt_vma_mmap(ctx, vma, dsp->reg_dsp_base_phy_addr_sram, DSP_SRAM_SIZE, false);
     }
-	else if (vma->vm_pgoff == 2)// Memory mapping for DMA buffer
+	else if (vma->vm_pgoff == DXRT_MMAP_DMA_BUF)// Memory mapping for DMA buffer
 	{        
         unsigned long size = vma->vm_end - vma->vm_start;
         ret = dma_mmap_coherent(dx->dev, vma, dsp->dma_buf, dsp->dma_buf_addr, size);
         pr_debug( "%s: mmap 0x%lx bytes, returned %d\n", f->f_path.dentry->d_iname, size, ret);        
     }
+    else if (vma->vm_pgoff == DXRT_MMAP_COMPLETION_RING)// Memory mapping for completion ring
+    {
+        if (size > ctx->completions.size)
+            ret = -EINVAL;
+        else
+            ret = remap_vmalloc_range(vma, ctx->completions.hdr, 0);
+    }
     else
     {
         pr_debug( "not supported vm_pgoff %ld : %s\n", vma->vm_pgoff, __func__);
@@ -145,26 +443,22 @@ static int dxrt_dev_mmap(struct file *f, struct vm_area_struct *vma)
     } else {
         pr_err( "%s: mmap 0x%lx bytes failed with %d\n", f->f_path.dentry->d_iname, size, ret);
     }
+    dxrt_dev_exit(dx, idx);
     
     return ret;
 }
 static unsigned int dxrt_dev_poll(struct file *f, poll_table *wait)
 {
-    struct dxdev *dx = f->private_data;
+    struct dxrt_file_ctx *ctx = f->private_data;
     
     unsigned int mask = 0;
-    unsigned long flags;
     pr_debug( "%s: %s\n", f->f_path.dentry->d_iname, __func__);
         
-    struct dxdsp *dsp = dx->dsp;
-    poll_wait(f, &dsp->irq_wq, wait);
-    spin_lock_irqsave(&dsp->irq_event_lock, flags);
-    if(dsp->irq_event)
+    poll_wait(f, &ctx->wq, wait);
+    if(atomic_xchg(&ctx->event, 0) || !dxrt_completion_ring_empty(&ctx->completions))
     {
         mask = POLLIN | POLLRDNORM;
-        dsp->irq_event = 0;
     }
-    spin_unlock_irqrestore(&dsp->irq_event_lock, flags);
     return mask;
 }
 
@@ -187,7 +481,8 @@ static unsigned int dxrt_dev_poll(struct file *f, poll_table *wait)
 static long dxrt_dev_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
     int num = iminor(f->f_inode);
-    struct dxdev *dx = f->private_data;
+    struct dxrt_file_ctx *ctx = f->private_data;
+    struct dxdev *dx = ctx->dx;
     dxrt_message_t msg;
     pr_debug( "%s: ioctl() cmd %d\n", f->f_path.dentry->d_iname, cmd);    
     if (_IOC_TYPE(cmd) != DXRT_IOCTL_MAGIC || \
@@ -205,9 +500,15 @@ static long dxrt_dev_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
             }
             if(msg.cmd >=0 && msg.cmd < DXRT_CMD_MAX)
             {
+                int idx, ret;
                 pr_debug( MODULE_NAME "%d: message %d\n", num, msg.cmd);
 
-                return message_handler_general(dx, &msg);
+                idx = dxrt_dev_enter(dx);
+                if (idx < 0)
+                    return idx;
+                ret = message_handler_general(dx, &msg, ctx);
+                dxrt_dev_exit(dx, idx);
+                return ret;
                 // return message_handler[msg.cmd](dx, msg.data);
             }
             else
@@ -231,11 +532,16 @@ static struct file_operations dxrt_cdev_fops =
     .read = dxrt_dev_read,
     .write = dxrt_dev_write,
     .mmap = dxrt_dev_mmap,
+    .get_unmapped_area = dxrt_dev_get_unmapped_area,
     .unlocked_ioctl = dxrt_dev_ioctl,
-    .poll = dxrt_dev_poll
+    .poll = dxrt_dev_poll,
+#ifdef DXRT_HAS_URING_CMD
+    .uring_cmd = dxrt_dev_uring_cmd,
+#endif
 };
 
-static struct dxdev* create_dxrt_device(int id, struct dxrt_driver *drv, struct file_operations *fops)
+static struct dxdev* create_dxrt_device(int id, struct dxrt_driver *drv, struct platform_device *pdev,
+    struct file_operations *fops)
 {
     int ret;
     struct dxdev* dxdev = kmalloc(sizeof(struct dxdev), GFP_KERNEL);
@@ -245,72 +551,319 @@ static struct dxdev* create_dxrt_device(int id, struct dxrt_driver *drv, struct
         return NULL;
     }
     memset(dxdev, 0, sizeof(struct dxdev));
+    kref_init(&dxdev->ref);
+    if (init_srcu_struct(&dxdev->srcu) < 0)
+    {
+        kfree(dxdev);
+        return NULL;
+    }
 
-    dxdev->pdev = drv->pdev;
+    dxdev->pdev = pdev;
     dxdev->id = id;
     dxdev->type = DEVICE_TYPE;
     dxdev->variant = DEVICE_VARIANT;
     cdev_init(&dxdev->cdev, fops);
     dxdev->cdev.owner = THIS_MODULE;
+    if ((ret = dxrt_submit_queue_init(&dxdev->requests, request_ring_depth)) < 0)
+        goto err_srcu;
+    if ((ret = dxrt_sched_init(&dxdev->sched, dxdev->requests.nr * dxdev->requests.depth)) < 0)
+        goto err_queue;
+    INIT_LIST_HEAD(&dxdev->files);
+    mutex_init(&dxdev->files_lock);
+    mutex_init(&dxdev->tune_lock);
+    init_waitqueue_head(&dxdev->request_wq);
+    init_waitqueue_head(&dxdev->request_space_wq);
+    init_waitqueue_head(&dxdev->error_wq);
+    spin_lock_init(&dxdev->error_lock);
+    mutex_init(&dxdev->msg_lock);
+    mutex_init(&dxdev->dispatch_lock);
     if ((ret = cdev_add(&dxdev->cdev, drv->dev_num + id, 1)) < 0)
     {
         pr_err( "%s: failed to add character device\n", __func__);
-        kfree(dxdev);
-        device_destroy(drv->dev_class, drv->dev_num);
-        class_destroy(drv->dev_class);
-        unregister_chrdev_region(drv->dev_num, drv->num_devices);
-        return NULL;
+        goto err_sched;
     }
 
-    if (IS_ERR(dxdev->dev = device_create(drv->dev_class, NULL, drv->dev_num + id, NULL, MODULE_NAME"%d", id)))
+    if (IS_ERR(dxdev->dev = device_create_with_groups(drv->dev_class, &pdev->dev, drv->dev_num + id, dxdev,
+                                                      dxrt_dev_groups, MODULE_NAME"%d", id)))
     {
         pr_err( "%s: failed to create device\n", __func__);
-        cdev_del(&dxdev->cdev);
-        kfree(dxdev);
-        class_destroy(drv->dev_class);
-        unregister_chrdev_region(drv->dev_num, drv->num_devices);
-        return NULL;
+        goto err_cdev;
     }
     dxdev->dev->dma_mask = (u64 *)&dmamask;
     dxdev->dev->coherent_dma_mask = DMA_BIT_MASK(32);
     dxdev->dsp = dxrt_dsp_init(dxdev);
-    INIT_LIST_HEAD(&dxdev->requests.list);
-    INIT_LIST_HEAD(&dxdev->responses.list);
-    
-    init_waitqueue_head(&dxdev->request_wq);
-    init_waitqueue_head(&dxdev->error_wq);
-        
-    spin_lock_init(&dxdev->requests_lock);
-    spin_lock_init(&dxdev->responses_lock);
-    spin_lock_init(&dxdev->error_lock);
-    mutex_init(&dxdev->msg_lock);
+    if (!dxdev->dsp)
+    {
+        pr_err( "%s: failed to initialize dsp %d\n", __func__, id);
+        goto err_device;
+    }
+    if (dxrt_dram_pool_init(&dxdev->mem, dxdev->dsp->reg_dsp_base_phy_addr_dram, DSP_DRAM_SIZE) < 0)
+    {
+        pr_err( "%s: failed to create the dram pool of dsp %d\n", __func__, id);
+        goto err_dsp;
+    }
+    if ((ret = dxrt_staging_init(dxdev)) < 0)
+    {
+        pr_err( "%s: failed to create the staging buffers of dsp %d\n", __func__, id);
+        goto err_pool;
+    }
     
-    dxdev->request_handler = kthread_run(
-        dxrt_request_handler, (void*)dxdev, "dxrt-th%d", dxdev->id
-    );
+    dxrt_dispatch_start(dxdev);
     
     pr_info(" [%d] created device %d:%d:%d, %p, %p\n",
         dxdev->variant, id,
         MAJOR(drv->dev_num + id), MINOR(drv->dev_num + id), dxdev->dev, dxdev->dsp);
     return dxdev;
+
+err_pool:
+    dxrt_dram_pool_deinit(&dxdev->mem);
+err_dsp:
+    dxrt_dsp_deinit(dxdev);
+err_device:
+    device_destroy(drv->dev_class, drv->dev_num + id);
+err_cdev:
+    cdev_del(&dxdev->cdev);
+err_sched:
+    dxrt_sched_deinit(&dxdev->sched);
+err_queue:
+    dxrt_submit_queue_deinit(&dxdev->requests);
+err_srcu:
+    cleanup_srcu_struct(&dxdev->srcu);
+    kfree(dxdev);
+    return NULL;
 }
+
+/*
+ * Files still open keep the structure : the device is marked dead and every
+ * file operation in progress is waited for (dxrt_dev_enter()), so that none of
+ * them sees the DSP, the pools or the queues after they are torn down.
+ */
 static void remove_dxrt_device(struct dxrt_driver *drv, struct dxdev* dxdev)
 {
-    dxrt_dsp_deinit(dxdev);
+    struct dxrt_file_ctx *ctx;
+
+    WRITE_ONCE(dxdev->dead, true);
+    /* waits of file operations : ring space, completions, staging buffers */
+    wake_up_interruptible_all(&dxdev->request_space_wq);
+    wake_up_all(&dxdev->staging.wq);
+    mutex_lock(&dxdev->files_lock);
+    list_for_each_entry(ctx, &dxdev->files, list)
+    {
+        atomic_set(&ctx->event, 1);
+        wake_up_interruptible_all(&ctx->wq);
+    }
+    mutex_unlock(&dxdev->files_lock);
+    synchronize_srcu(&dxdev->srcu);
+
+    /* no submit is left : the requests still queued are cancelled by the stop */
+    dxrt_dispatch_stop(dxdev);
+    /* the mappings of the open files : DRAM, SRAM and DMA buffer are all going away, faults now fail */
+    mutex_lock(&dxdev->files_lock);
+    list_for_each_entry(ctx, &dxdev->files, list)
+    {
+        if (ctx->mapping)
+            unmap_mapping_range(ctx->mapping, 0, 0, 1);
+    }
+    mutex_unlock(&dxdev->files_lock);
+
+    /* the class device stays allocated for the files which still have to unmap imports */
+    get_device(dxdev->dev);
     device_destroy(drv->dev_class, drv->dev_num + dxdev->id);
     cdev_del(&dxdev->cdev);
-    kfree(dxdev);    
+    dxrt_staging_deinit(dxdev);
+    dxrt_dsp_deinit(dxdev);
+    dxdev->dsp = NULL;
+    dxrt_dram_pool_deinit(&dxdev->mem);
+    dxrt_sched_deinit(&dxdev->sched);
+    dxrt_submit_queue_deinit(&dxdev->requests);
+    dxrt_dev_put(dxdev);
+}
+/*
+ * Aggregate node (/dev/dxrt_dsp_all) : every request of the file goes to the
+ * device with the fewest queued + in-flight requests, completions come back
+ * to the file whatever the device. Only the submission / completion
+ * interfaces are available, memory and device control stay on dxrt_dspN.
+ */
+static bool aggregate = false;
+module_param(aggregate, bool, 0444);
+MODULE_PARM_DESC(aggregate, "Create " MODULE_NAME "_all, which spreads requests over all DSPs by queue depth");
+
+static const bool dxrt_agg_cmd_allowed[DXRT_CMD_MAX] = {
+    [DXRT_CMD_IDENTIFY_DEVICE]      = true,
+    [DXRT_CMD_READ_OUTPUT_DMA_CH0]  = true,
+    [DXRT_CMD_READ_OUTPUT_DMA_CH1]  = true,
+    [DXRT_CMD_READ_OUTPUT_DMA_CH2]  = true,
+    [DXRT_CMD_TERMINATE]            = true,
+    [DXRT_CMD_DRV_INFO]             = true,
+    [DXRT_CMD_SCHEDULE]             = true,
+    [DXRT_CMD_DSP_RUN_REQ]          = true,
+    [DXRT_CMD_DSP_RUN_RESP]         = true,
+    [DXRT_CMD_POLL_MODE]            = true,
+};
+
+/*
+ * Least loaded device, the scan starts after the last pick so that ties are spread.
+ * The scan runs under RCU : dxrt_dsp_driver_remove_device() waits for it before
+ * the teardown. The caller gets a reference on the device returned (dxrt_dev_put()).
+ */
+struct dxdev *dxrt_aggregate_pick(struct dxrt_driver *drv)
+{
+    struct dxdev *best = NULL, *dx;
+    uint32_t load, best_load = UINT_MAX;
+    int i, start = atomic_inc_return(&drv->agg_next);
+
+    rcu_read_lock();
+    for (i = 0; i < DX_DEVICE_MAX_NUM; i++)
+    {
+        dx = rcu_dereference(drv->devices[(start + i) % DX_DEVICE_MAX_NUM]);
+        if (!dx)
+            continue;
+        load = dxrt_submit_queue_count(&dx->requests) + dxrt_sched_count(&dx->sched) +
+            READ_ONCE(dx->dsp->inflight_num);
+        if (load < best_load)
+        {
+            best = dx;
+            best_load = load;
+        }
+    }
+    if (best && !kref_get_unless_zero(&best->ref))
+        best = NULL;
+    rcu_read_unlock();
+    return best;
+}
+
+static int dxrt_agg_open(struct inode *i, struct file *f)
+{
+    struct dxrt_driver *drv = container_of(i->i_cdev, struct dxrt_driver, agg_cdev);
+    struct dxdev *dx;
+    int ret;
+
+    pr_debug( "%s: %s\n", f->f_path.dentry->d_iname, __func__);
+    /* accounting (clients, completion overflow) is kept on the first device */
+    dx = dxrt_aggregate_pick(drv);
+    if (!dx)
+        return -ENODEV;
+    ret = dxrt_dev_open_ctx(dx, f);
+    if (ret == 0)
+        ((struct dxrt_file_ctx *)f->private_data)->agg = drv;
+    dxrt_dev_put(dx);
+    return ret;
+}
+
+static long dxrt_agg_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+    struct dxrt_file_ctx *ctx = f->private_data;
+    dxrt_message_t msg;
+    int idx, ret;
+
+    if (cmd != DXRT_IOCTL_MESSAGE)
+        return dxrt_dev_ioctl(f, cmd, arg);
+    if (copy_from_user(&msg, (void __user*)arg, sizeof(msg)))
+        return -EFAULT;
+    if (msg.cmd < 0 || msg.cmd >= DXRT_CMD_MAX || !dxrt_agg_cmd_allowed[msg.cmd])
+    {
+        pr_debug( MODULE_NAME "_all: message %d not supported\n", msg.cmd);
+        return -EOPNOTSUPP;
+    }
+    if (msg.cmd == DXRT_CMD_POLL_MODE && msg.sub_cmd != DX_POLL_IRQ)
+        return -EOPNOTSUPP;
+    idx = dxrt_dev_enter(ctx->dx);
+    if (idx < 0)
+        return idx;
+    ret = message_handler_general(ctx->dx, &msg, ctx);
+    dxrt_dev_exit(ctx->dx, idx);
+    return ret;
+}
+
+static int dxrt_agg_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff != DXRT_MMAP_COMPLETION_RING)
+        return -EINVAL;
+    return dxrt_dev_mmap(f, vma);
+}
+
+static struct file_operations dxrt_agg_fops =
+{
+    .owner = THIS_MODULE,
+    .open = dxrt_agg_open,
+    .release = dxrt_dev_release,
+    .read = dxrt_dev_read,
+    .write = dxrt_dev_write,
+    .mmap = dxrt_agg_mmap,
+    .unlocked_ioctl = dxrt_agg_ioctl,
+    .poll = dxrt_dev_poll,
+#ifdef DXRT_HAS_URING_CMD
+    .uring_cmd = dxrt_dev_uring_cmd,
+#endif
+};
+
+/* Device index : "device-id" of the node if it is free, otherwise the first free one */
+static int dxrt_dsp_driver_pick_id(struct dxrt_driver *drv, struct platform_device *pdev)
+{
+    u32 id;
+    int i;
+
+    if (of_property_read_u32(pdev->dev.of_node, "device-id", &id) == 0 &&
+        id < DX_DEVICE_MAX_NUM && rcu_access_pointer(drv->devices[id]) == NULL)
+        return id;
+    for (i = 0; i < DX_DEVICE_MAX_NUM; i++)
+    {
+        if (rcu_access_pointer(drv->devices[i]) == NULL)
+            return i;
+    }
+    return -ENOSPC;
+}
+
+/* Called by probe for every DSP node of the device tree */
+struct dxdev *dxrt_dsp_driver_add_device(struct dxrt_driver *drv, struct platform_device *pdev)
+{
+    struct dxdev *dx;
+    int id;
+
+    mutex_lock(&drv->lock);
+    id = dxrt_dsp_driver_pick_id(drv, pdev);
+    if (id < 0)
+    {
+        mutex_unlock(&drv->lock);
+        pr_err( "%s: more than %d dsp nodes\n", __func__, DX_DEVICE_MAX_NUM);
+        return ERR_PTR(id);
+    }
+    dx = create_dxrt_device(id, drv, pdev, &dxrt_cdev_fops);
+    if (dx == NULL)
+    {
+        mutex_unlock(&drv->lock);
+        return ERR_PTR(-ENODEV);
+    }
+    rcu_assign_pointer(drv->devices[id], dx);
+    drv->num_devices++;
+    mutex_unlock(&drv->lock);
+    return dx;
 }
 
+void dxrt_dsp_driver_remove_device(struct dxrt_driver *drv, struct dxdev *dx)
+{
+    mutex_lock(&drv->lock);
+    RCU_INIT_POINTER(drv->devices[dx->id], NULL);
+    drv->num_devices--;
+    mutex_unlock(&drv->lock);
+    /* dxrt_aggregate_pick() scans without the lock */
+    synchronize_rcu();
+
+    remove_dxrt_device(drv, dx);
+}
+
+/* Called once at module load, devices are added by probe */
 int dxrt_dsp_driver_cdev_init(struct dxrt_driver *drv)
 {
-    int i, ret;
+    int ret;
     pr_debug( "%s\n", __func__);
 
-    drv->num_devices = 1;//NUM_DEVICES;
+    mutex_init(&drv->lock);
+    drv->num_devices = 0;
+    atomic_set(&drv->agg_next, 0);
 
-    pr_info("%s: %d devices\n", __func__, drv->num_devices);
-    if ((ret = alloc_chrdev_region(&drv->dev_num, 0, drv->num_devices, MODULE_NAME)) < 0)
+    /* minors 0..DX_DEVICE_MAX_NUM-1 : dxrt_dspN, DX_DEVICE_MAX_NUM : aggregate */
+    if ((ret = alloc_chrdev_region(&drv->dev_num, 0, DX_DEVICE_MAX_NUM + 1, MODULE_NAME)) < 0)
     {
         return ret;
     }
@@ -320,15 +873,27 @@ int dxrt_dsp_driver_cdev_init(struct dxrt_driver *drv)
     if (IS_ERR(drv->dev_class = class_create(THIS_MODULE, MODULE_NAME)))
 #endif
     {
-        unregister_chrdev_region(drv->dev_num, drv->num_devices);
+        unregister_chrdev_region(drv->dev_num, DX_DEVICE_MAX_NUM + 1);
         return PTR_ERR(drv->dev_class);
     }
-    for(i=0;i<drv->num_devices;i++)
+    if (aggregate)
     {
-        drv->devices[i] = create_dxrt_device(i, drv, &dxrt_cdev_fops);
-        if(drv->devices[i]==NULL)
+        cdev_init(&drv->agg_cdev, &dxrt_agg_fops);
+        drv->agg_cdev.owner = THIS_MODULE;
+        if ((ret = cdev_add(&drv->agg_cdev, drv->dev_num + DXRT_AGGREGATE_MINOR, 1)) < 0 ||
+            IS_ERR(drv->agg_dev = device_create(drv->dev_class, NULL, drv->dev_num + DXRT_AGGREGATE_MINOR,
+                                                drv, MODULE_NAME"_all")))
         {
-            return -1;
+            pr_err( "%s: failed to create the aggregate device\n", __func__);
+            if (ret == 0)
+            {
+                cdev_del(&drv->agg_cdev);
+                ret = PTR_ERR(drv->agg_dev);
+            }
+            drv->agg_dev = NULL;
+            class_destroy(drv->dev_class);
+            unregister_chrdev_region(drv->dev_num, DX_DEVICE_MAX_NUM + 1);
+            return ret;
         }
     }
     pr_debug( "%s done.\n", __func__);
@@ -337,21 +902,13 @@ int dxrt_dsp_driver_cdev_init(struct dxrt_driver *drv)
 }
 void dxrt_dsp_driver_cdev_deinit(struct dxrt_driver *drv)
 {
-    int i;
-
-    struct task_struct *request_handler;
     pr_debug( "%s\n", __func__);
-    for(i=0;i<drv->num_devices;i++)
+    if (drv->agg_dev)
     {
-        request_handler = drv->devices[i]->request_handler;
-        if(request_handler)
-        {
-            kthread_stop(request_handler);
-        }
-
-        remove_dxrt_device(drv, drv->devices[i]);
+        device_destroy(drv->dev_class, drv->dev_num + DXRT_AGGREGATE_MINOR);
+        cdev_del(&drv->agg_cdev);
     }
     class_destroy(drv->dev_class);
-    unregister_chrdev_region(drv->dev_num, drv->num_devices);
+    unregister_chrdev_region(drv->dev_num, DX_DEVICE_MAX_NUM + 1);
     pr_debug( "%s done.\n", __func__);
 }
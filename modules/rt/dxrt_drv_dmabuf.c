@@ -0,0 +1,307 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include "dxrt_drv.h"
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+MODULE_IMPORT_NS("DMA_BUF");
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0))
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+/*
+ * Exported DSP DRAM buffer : holds a reference on the buffer until the dma-buf is released.
+ * It may outlive the device, so it only keeps what the dma-buf ops need.
+ */
+struct dxrt_dmabuf_exp {
+    dxrt_dram_buf_t *buf;
+    phys_addr_t phys;
+};
+
+/*
+ * The DSP DRAM window is not backed by struct page, so every attachment gets
+ * a single-entry table mapped with dma_map_resource() (importers must not use sg_page()).
+ */
+static struct sg_table *dxrt_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+    struct dxrt_dmabuf_exp *exp = attach->dmabuf->priv;
+    struct sg_table *sgt;
+    dma_addr_t addr;
+
+    /* the device is gone : the range may belong to the next probe */
+    if (!READ_ONCE(exp->buf->mem))
+        return ERR_PTR(-ENODEV);
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt)
+        return ERR_PTR(-ENOMEM);
+    if (sg_alloc_table(sgt, 1, GFP_KERNEL))
+    {
+        kfree(sgt);
+        return ERR_PTR(-ENOMEM);
+    }
+    addr = dma_map_resource(attach->dev, exp->phys, exp->buf->size, dir, 0);
+    if (dma_mapping_error(attach->dev, addr))
+    {
+        pr_err("%s: failed to map 0x%x bytes for %s\n", __func__, exp->buf->size, dev_name(attach->dev));
+        sg_free_table(sgt);
+        kfree(sgt);
+        return ERR_PTR(-ENOMEM);
+    }
+    sg_dma_address(sgt->sgl) = addr;
+    sg_dma_len(sgt->sgl) = exp->buf->size;
+    return sgt;
+}
+
+static void dxrt_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir)
+{
+    dma_unmap_resource(attach->dev, sg_dma_address(sgt->sgl), sg_dma_len(sgt->sgl), dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static void dxrt_dmabuf_release(struct dma_buf *dmabuf)
+{
+    struct dxrt_dmabuf_exp *exp = dmabuf->priv;
+
+    pr_debug("%s: offset 0x%x\n", __func__, exp->buf->offset);
+    dxrt_dram_buf_put(exp->buf);
+    kfree(exp);
+}
+
+static int dxrt_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct dxrt_dmabuf_exp *exp = dmabuf->priv;
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    if (!READ_ONCE(exp->buf->mem))
+        return -ENODEV;
+    if ((vma->vm_pgoff << PAGE_SHIFT) + size > exp->buf->size)
+        return -EINVAL;
+    /* same attributes as the DRAM window of the device node */
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    return remap_pfn_range(vma, vma->vm_start, PHYS_PFN(exp->phys) + vma->vm_pgoff,
+        size, vma->vm_page_prot);
+}
+
+/* CPU mappings of the DSP DRAM are uncached : CPU access only has to be ordered against the device */
+static int dxrt_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+    mb();
+    return 0;
+}
+
+static int dxrt_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+    mb();
+    return 0;
+}
+
+static const struct dma_buf_ops dxrt_dmabuf_ops = {
+    .map_dma_buf = dxrt_dmabuf_map,
+    .unmap_dma_buf = dxrt_dmabuf_unmap,
+    .release = dxrt_dmabuf_release,
+    .mmap = dxrt_dmabuf_mmap,
+    .begin_cpu_access = dxrt_dmabuf_begin_cpu_access,
+    .end_cpu_access = dxrt_dmabuf_end_cpu_access,
+};
+
+/* DX_DMABUF_EXPORT : returns a dma-buf fd for the DRAM buffer of @ctx at arg->dsp_buf_offset */
+int dxrt_dmabuf_export(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_dmabuf_t *arg)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct dxrt_dmabuf_exp *exp;
+    struct dma_buf *dmabuf;
+    dxrt_dram_buf_t *b;
+    int fd;
+
+    b = dxrt_dram_buf_get(&dx->mem, arg->dsp_buf_offset);
+    if (!b)
+        return -EINVAL;
+    /* the owner of a live buffer never changes : only the file which allocated it exports it */
+    if (b->owner != ctx)
+    {
+        dxrt_dram_buf_put(b);
+        return -EINVAL;
+    }
+    exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+    if (!exp)
+    {
+        dxrt_dram_buf_put(b);
+        return -ENOMEM;
+    }
+    exp->buf = b;
+    exp->phys = dx->mem.base + b->offset;
+
+    exp_info.exp_name = MODULE_NAME;
+    exp_info.ops = &dxrt_dmabuf_ops;
+    exp_info.size = b->size;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = exp;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf))
+    {
+        dxrt_dram_buf_put(b);
+        kfree(exp);
+        return PTR_ERR(dmabuf);
+    }
+    fd = dma_buf_fd(dmabuf, arg->flags & O_CLOEXEC);
+    if (fd < 0)
+    {
+        dma_buf_put(dmabuf);    /* releases exp and the buffer reference */
+        return fd;
+    }
+    arg->fd = fd;
+    arg->size = b->size;
+    pr_debug("%d: %s: offset 0x%x size 0x%x fd %d\n", dx->id, __func__, b->offset, b->size, fd);
+    return 0;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0))
+#define dxrt_dmabuf_map_attachment      dma_buf_map_attachment_unlocked
+#define dxrt_dmabuf_unmap_attachment    dma_buf_unmap_attachment_unlocked
+#else
+#define dxrt_dmabuf_map_attachment      dma_buf_map_attachment
+#define dxrt_dmabuf_unmap_attachment    dma_buf_unmap_attachment
+#endif
+
+/* The DSP takes a single base address per buffer : the DMA segments must be contiguous */
+int dxrt_sgt_dev_addr(struct sg_table *sgt, dma_addr_t *addr, size_t *size)
+{
+    struct scatterlist *sg;
+    dma_addr_t next = 0;
+    size_t len = 0;
+    int i;
+
+    for_each_sgtable_dma_sg(sgt, sg, i)
+    {
+        if (i > 0 && sg_dma_address(sg) != next)
+            return -EINVAL;
+        next = sg_dma_address(sg) + sg_dma_len(sg);
+        len += sg_dma_len(sg);
+    }
+    if (len == 0)
+        return -EINVAL;
+    *addr = sg_dma_address(sgt->sgl);
+    *size = len;
+    return 0;
+}
+
+static void dxrt_handle_destroy(struct dxdev *dx, dxrt_handle_t *h)
+{
+    pr_debug("%d: %s: type %u addr %pad size 0x%x\n", dx->id, __func__, h->type, &h->dev_addr, h->size);
+    switch (h->type) {
+    case DXRT_HANDLE_DMABUF:
+        dxrt_dmabuf_unmap_attachment(h->attach, h->sgt, DMA_BIDIRECTIONAL);
+        dma_buf_detach(h->dmabuf, h->attach);
+        dma_buf_put(h->dmabuf);
+        break;
+#ifdef DXRT_HAS_USERPTR
+    case DXRT_HANDLE_USERPTR:
+        dxrt_userptr_unmap(dx, h);
+        break;
+#endif
+    default:
+        break;
+    }
+    kfree(h);
+}
+
+/* DX_DMABUF_IMPORT : maps the dma-buf arg->fd for the DSP, returns handle / dev_addr / size */
+int dxrt_dmabuf_import(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_dmabuf_t *arg)
+{
+    dxrt_handle_t *h;
+    dma_addr_t addr;
+    size_t size;
+    u32 id;
+    int ret;
+
+    h = kzalloc(sizeof(*h), GFP_KERNEL);
+    if (!h)
+        return -ENOMEM;
+    h->type = DXRT_HANDLE_DMABUF;
+    h->dmabuf = dma_buf_get(arg->fd);
+    if (IS_ERR(h->dmabuf))
+    {
+        ret = PTR_ERR(h->dmabuf);
+        goto err_free;
+    }
+    h->attach = dma_buf_attach(h->dmabuf, dx->dev);
+    if (IS_ERR(h->attach))
+    {
+        ret = PTR_ERR(h->attach);
+        goto err_put;
+    }
+    h->sgt = dxrt_dmabuf_map_attachment(h->attach, DMA_BIDIRECTIONAL);
+    if (IS_ERR(h->sgt))
+    {
+        ret = PTR_ERR(h->sgt);
+        goto err_detach;
+    }
+    ret = dxrt_sgt_dev_addr(h->sgt, &addr, &size);
+    if (ret || size > U32_MAX || addr + size - 1 > DMA_BIT_MASK(32))
+    {
+        pr_err("%d: %s: fd %d is not contiguous below 4GB for the dsp\n", dx->id, __func__, arg->fd);
+        ret = -EINVAL;
+        goto err_unmap;
+    }
+    h->dev_addr = addr;
+    h->size = size;
+    ret = xa_alloc(&ctx->handles, &id, h, xa_limit_32b, GFP_KERNEL);
+    if (ret)
+        goto err_unmap;
+
+    arg->handle = id;
+    arg->dev_addr = h->dev_addr;
+    arg->size = h->size;
+    pr_debug("%d: %s: fd %d -> handle %u addr %pad size 0x%x\n", dx->id, __func__, arg->fd, id, &h->dev_addr, h->size);
+    return 0;
+
+err_unmap:
+    dxrt_dmabuf_unmap_attachment(h->attach, h->sgt, DMA_BIDIRECTIONAL);
+err_detach:
+    dma_buf_detach(h->dmabuf, h->attach);
+err_put:
+    dma_buf_put(h->dmabuf);
+err_free:
+    kfree(h);
+    return ret;
+}
+
+/* Returns 0, or -EINVAL if @handle is not owned by @ctx */
+int dxrt_handle_release(struct dxdev *dx, struct dxrt_file_ctx *ctx, uint32_t handle)
+{
+    dxrt_handle_t *h;
+
+    mutex_lock(&ctx->handle_lock);
+    h = xa_erase(&ctx->handles, handle);
+    mutex_unlock(&ctx->handle_lock);
+    if (!h)
+        return -EINVAL;
+    dxrt_handle_destroy(dx, h);
+    return 0;
+}
+
+/* Unmaps every buffer still imported by a closing file */
+void dxrt_handle_release_ctx(struct dxdev *dx, struct dxrt_file_ctx *ctx)
+{
+    dxrt_handle_t *h;
+    unsigned long id;
+
+    xa_for_each(&ctx->handles, id, h)
+    {
+        xa_erase(&ctx->handles, id);
+        dxrt_handle_destroy(dx, h);
+    }
+    xa_destroy(&ctx->handles);
+}
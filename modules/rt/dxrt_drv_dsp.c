@@ -12,9 +12,14 @@
 #include <linux/interrupt.h>
 #include <linux/delay.h>
 #include <linux/spinlock.h>
+#include <linux/moduleparam.h>
 
 #include "dxrt_drv.h"
 
+static unsigned int pipeline_depth = 1;
+module_param(pipeline_depth, uint, 0444);
+MODULE_PARM_DESC(pipeline_depth, "Max DSP messages in flight (default 1: serial, as before; more needs a firmware raising one IRQ per message, in order; up to DSP_MSG_SLOT_NUM)");
+
 struct dxdsp_cfg dsp_cfg = {
 #if DEVICE_VARIANT==DX_V3
     /* DX-V3 */
@@ -23,6 +28,10 @@ struct dxdsp_cfg dsp_cfg = {
     .init = dx_v3_dsp_init,
     .prepare_inference = dx_v3_dsp_prepare_inference,
     .run = dx_v3_dsp_run,
+    .try_run = dx_v3_dsp_try_run,
+    .wait_credit = dx_v3_dsp_wait_credit,
+    .poll = dx_v3_dsp_poll,
+    .poll_delay = dx_v3_dsp_poll_delay,
     .reg_dump = dx_v3_dsp_reg_dump,
     .deinit = dx_v3_dsp_deinit,    
 #else
@@ -52,10 +61,14 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
         dsp->init = dsp_cfg.init;
         dsp->prepare_inference = dsp_cfg.prepare_inference;
         dsp->run = dsp_cfg.run;
+        dsp->try_run = dsp_cfg.try_run;
+        dsp->wait_credit = dsp_cfg.wait_credit;
+        dsp->poll = dsp_cfg.poll;
+        dsp->poll_delay = dsp_cfg.poll_delay;
         dsp->reg_dump = dsp_cfg.reg_dump;
         dsp->deinit = dsp_cfg.deinit;        
         dsp->dx = dxdev;
-        dsp->response = &dxdev->response;
+        dsp->pipeline_depth = clamp_t(uint32_t, pipeline_depth, 1, DSP_MSG_SLOT_NUM);
         // dsp->status = 0;
         spin_lock_init(&dsp->irq_event_lock);
         // setup from platform device
@@ -70,7 +83,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
             res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
             if (res==NULL) {
                 pr_err( "%s: failed to find IO resource0 for dsp.\n", __func__);
-                return NULL;
+                goto err_free;
             }
             dsp->reg_dsp_base_phy_addr = res->start;
 
@@ -78,7 +91,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
             res = platform_get_resource(pdev, IORESOURCE_MEM, 1);
             if (res==NULL) {
                 pr_err( "%s: failed to find IO resource1 for dsp.\n", __func__);
-                return NULL;
+                goto err_free;
             }
             dsp->reg_dsp_base_phy_addr_debug_pwr = res->start;
 
@@ -86,7 +99,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
             res = platform_get_resource(pdev, IORESOURCE_MEM, 2);
             if (res==NULL) {
                 pr_err( "%s: failed to find IO resource2 for dsp.\n", __func__);
-                return NULL;
+                goto err_free;
             }
             dsp->reg_dsp_base_phy_addr_debug = res->start;
 
@@ -94,7 +107,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
             res = platform_get_resource(pdev, IORESOURCE_MEM, 3);
             if (res==NULL) {
                 pr_err( "%s: failed to find IO resource3 for dsp.\n", __func__);
-                return NULL;
+                goto err_free;
             }
             dsp->reg_dsp_base_phy_addr_mailbox = res->start;
 
@@ -102,7 +115,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
             res = platform_get_resource(pdev, IORESOURCE_MEM, 4);
             if (res==NULL) {
                 pr_err( "%s: failed to find IO resource4 for dsp.\n", __func__);
-                return NULL;
+                goto err_free;
             }
             dsp->reg_dsp_base_phy_addr_sram = res->start;			
             pr_debug( "%s sram phy_addr = %x \n", __func__, dsp->reg_dsp_base_phy_addr_sram);
@@ -111,7 +124,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
             res = platform_get_resource(pdev, IORESOURCE_MEM, 5);
             if (res==NULL) {
                 pr_err( "%s: failed to find IO resource5 for dsp.\n", __func__);
-                return NULL;
+                goto err_free;
             }
             dsp->reg_dsp_base_phy_addr_rom_ram = res->start;
             pr_debug( "%s rom_ram phy_addr = %x \n", __func__, dsp->reg_dsp_base_phy_addr_rom_ram);
@@ -120,7 +133,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
             res = platform_get_resource(pdev, IORESOURCE_MEM, 6);
             if (res==NULL) {
                 pr_err( "%s: failed to find IO resource6 for dsp.\n", __func__);
-                return NULL;
+                goto err_free;
             }
             dsp->reg_dsp_base_phy_addr_dram = res->start;			
 			pr_debug( "%s dram phy_addr = %x \n", __func__, dsp->reg_dsp_base_phy_addr_dram);
@@ -129,7 +142,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
             dsp->irq_num = platform_get_irq(pdev, 0);//HOST_EXTSYS0_MHU0_SENDER_INTR = 43
             if (dsp->irq_num < 0) {
                 pr_err( "%s: failed to find IRQ number for dsp.\n", __func__);
-                return NULL;
+                goto err_free;
             }
             
             {
@@ -137,7 +150,7 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
                 if (prop==NULL)
                 {
                     pr_err( "%s: failed to find device-id for dsp.\n", __func__);
-                    return NULL;
+                    goto err_free;
                 }
                 dsp->id = be32_to_cpup(prop);
             }
@@ -146,16 +159,22 @@ struct dxdsp *dxrt_dsp_init(void *dxdev_)
                 if (prop==NULL)
                 {
                     pr_err( "%s: failed to find dma-buf-size for dsp.\n", __func__);
-                    return NULL;
+                    goto err_free;
                 }
                 dsp->dma_buf_size = be32_to_cpup(prop);
             }
         }
     }
-    if (dsp) {
-        dsp->init(dsp);
+    if (dsp->init(dsp) < 0)
+    {
+        pr_err( "%s: failed to initialize dsp %d\n", __func__, dsp->id);
+        goto err_free;
     }
     return dsp;
+
+err_free:
+    kfree(dsp);
+    return NULL;
 }
 void dxrt_dsp_deinit(void *dxdev_)
 {
@@ -6,11 +6,17 @@
  *
  */
 
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
 #include "dxrt_drv_dsp.h"
 #include "dxrt_drv.h"
 
-// Global DSP memory manager instance
-dxrt_dsp_buffer_manager_t g_dsp_memory_manager;
+static unsigned int dispatch_spin_us = 0;
+module_param(dispatch_spin_us, uint, 0644);
+MODULE_PARM_DESC(dispatch_spin_us, "Spin up to N us for a free DSP slot before sleeping until the IRQ (0: sleep)");
 
 inline void dsp_reg_write(volatile void __iomem *base, uint32_t addr, uint32_t val)
 {
@@ -37,45 +43,234 @@ inline uint32_t dsp_reg_read_mask(volatile void __iomem *base, uint32_t addr, ui
     return (read_val & mask) >> bit_offset;
 }
 
-static irqreturn_t dsp_irq_handler(int irq, void *data)
+static void dx_v3_dsp_fill_completion(dxdsp_t *dsp, uint32_t slot, int32_t status, uint64_t irq_ns,
+    dxrt_completion_t *comp)
 {
-    unsigned long flags;
-    dxdsp_t *dsp = (dxdsp_t*)data;    
-    volatile void __iomem *reg_dsp_mailbox = dsp->reg_dsp_base_mailbox;
-    volatile void __iomem *reg_dsp = dsp->reg_dsp_base;
-    dxrt_response_t *response = dsp->response;
-    
-    uint32_t irq_status_ch0, irq_status_ch1;
+    struct dxdsp_inflight *rec = &dsp->inflight_req[slot];
+
+    memset(comp, 0, sizeof(dxrt_completion_t));
+    comp->response.req_id = rec->req_id;
+    comp->response.status = status;
+    comp->response.inf_time = (uint32_t)div_u64(irq_ns - rec->dispatch_ns, NSEC_PER_USEC);
+    comp->submit_ns = rec->submit_ns;
+    comp->dispatch_ns = rec->dispatch_ns;
+    comp->irq_ns = irq_ns;
+}
 
-    pr_debug("dsp%d irq: %x\n", dsp->id, irq); // this log causes worse latency.
+static void dx_v3_dsp_slot_release(dxdsp_t *dsp, int fifo_idx)
+{
+    uint32_t slot = dsp->inflight_fifo[fifo_idx];
 
-    // IRQ status
-#if 1	
-    irq_status_ch0 = READ_DSP_IRQ_STATUS_CH0(reg_dsp_mailbox);
-    irq_status_ch1 = READ_DSP_IRQ_STATUS_CH1(reg_dsp_mailbox);
+    __clear_bit(slot, &dsp->inflight);
+    dsp->inflight_num--;
+    memmove(&dsp->inflight_fifo[fifo_idx], &dsp->inflight_fifo[fifo_idx + 1],
+        (dsp->inflight_num - fifo_idx) * sizeof(uint32_t));
+    dsp->credits++;
+}
 
-    pr_debug("%s irq_status_ch0 =%d\n", __func__, irq_status_ch0);
-    pr_debug("%s irq_status_ch1 =%d\n", __func__, irq_status_ch1);
-#endif
+/* EWMA (1/8) of the execution time, used to schedule hybrid polling */
+static void dx_v3_dsp_exec_est_update(dxdsp_t *dsp, uint16_t func_id, uint64_t exec_ns)
+{
+    uint64_t *est = &dsp->exec_est_ns[func_id % DSP_EXEC_EST_NUM];
+    uint64_t old = READ_ONCE(*est);
 
-    // get response
-    response->req_id = dsp->req_id;
-    
-    // clear IRQ    
+    WRITE_ONCE(*est, old ? old - (old >> 3) + (exec_ns >> 3) : exec_ns);
+}
+
+/*
+ * Collect the request which the DSP has completed.
+ * The firmware raises the mailbox IRQ once per message and runs the messages in the
+ * order they were written, so a raised IRQ completes the oldest slot of inflight_fifo.
+ * Called from the IRQ handler and from hybrid pollers, so the mailbox status
+ * is read and cleared under inflight_lock : only one of them reaps a given IRQ.
+ * Slots acquired but not written yet are not in inflight_fifo (see dx_v3_dsp_write_request()).
+ * Returns 1 if @done and @owner were filled, 0 otherwise.
+ */
+static int dx_v3_dsp_collect_done(dxdsp_t *dsp, uint64_t irq_ns, dxrt_completion_t *done,
+    struct dxdsp_inflight *owner)
+{
+    volatile void __iomem *reg_dsp_mailbox = dsp->reg_dsp_base_mailbox;
+    uint32_t irq_status;
+    unsigned long flags;
+    uint64_t start;
+
+    spin_lock_irqsave(&dsp->inflight_lock, flags);
+    irq_status = READ_DSP_IRQ_STATUS_CH0(reg_dsp_mailbox) | READ_DSP_IRQ_STATUS_CH1(reg_dsp_mailbox);
+    if (!irq_status)
+    {
+        spin_unlock_irqrestore(&dsp->inflight_lock, flags);
+        return 0;
+    }
+    // clear IRQ
     WRITE_DSP_IRQ_CLR_CH0(reg_dsp_mailbox, 1);
     WRITE_DSP_IRQ_CLR_CH1(reg_dsp_mailbox, 1);
+    if (dsp->inflight_num == 0)
+    {
+        spin_unlock_irqrestore(&dsp->inflight_lock, flags);
+        pr_debug("dsp%d: irq %x with no message in flight\n", dsp->id, irq_status);
+        return 0;
+    }
+    *owner = dsp->inflight_req[dsp->inflight_fifo[0]];
+    dx_v3_dsp_fill_completion(dsp, dsp->inflight_fifo[0], 0, irq_ns, done);
+    dx_v3_dsp_slot_release(dsp, 0);
+    if (dsp->inflight_num == 0)
+        WRITE_DSP_STATUS(dsp->reg_dsp_base, 0x0);// set dsp state to idle
+    /*
+     * Pipelined requests overlap their dispatch-to-irq times : the DSP time since
+     * the previous completion (or since the dispatch, if the DSP was idle) is charged.
+     */
+    start = max(done->dispatch_ns, dsp->last_done_ns);
+    owner->exec_ns = irq_ns > start ? irq_ns - start : 0;
+    dsp->last_done_ns = irq_ns;
+    spin_unlock_irqrestore(&dsp->inflight_lock, flags);
+
+    dx_v3_dsp_exec_est_update(dsp, owner->func_id, done->irq_ns - done->dispatch_ns);
+    return 1;
+}
 
-    // set dsp state to idle
-    WRITE_DSP_STATUS(reg_dsp, 0x0);
+/* Reap the completed request and route it to its file, returns the number completed */
+static int dx_v3_dsp_reap(dxdsp_t *dsp, uint64_t now_ns)
+{
+    dxrt_completion_t done;
+    struct dxdsp_inflight owner;
+
+    // get the response, return the credit and wake up the dispatcher
+    if (!dx_v3_dsp_collect_done(dsp, now_ns, &done, &owner))
+        return 0;
+    wake_up_interruptible(&dsp->credit_wq);
+
+    // route the completion to the file which submitted it
+    dxrt_sched_charge(owner.ctx, owner.exec_ns);
+    dxrt_job_complete(owner.ctx, owner.ucmd, &done);
+    return 1;
+}
+
+static bool dx_v3_dsp_slot_acquire(dxdsp_t *dsp, dxrt_dsp_job_t *job)
+{
+    uint32_t slot = job->request.req_id;
+    unsigned long flags;
+    bool acquired = false;
 
-    // wakeup waitqueue
-    spin_lock_irqsave(&dsp->irq_event_lock, flags);
-	dsp->irq_event = 1;	
-	spin_unlock_irqrestore(&dsp->irq_event_lock, flags);
-    wake_up_interruptible(&dsp->irq_wq);
+    spin_lock_irqsave(&dsp->inflight_lock, flags);
+    if (dsp->credits > 0 && !test_bit(slot, &dsp->inflight))
+    {
+        dsp->credits--;
+        __set_bit(slot, &dsp->inflight);
+        dsp->inflight_req[slot].ctx = job->ctx;
+        dsp->inflight_req[slot].ucmd = job->ucmd;
+        dsp->inflight_req[slot].req_id = slot;
+        dsp->inflight_req[slot].func_id = job->request.msg_header.func_id;
+        dsp->inflight_req[slot].submit_ns = job->submit_ns;
+        dsp->inflight_req[slot].dispatch_ns = 0;
+        acquired = true;
+    }
+    spin_unlock_irqrestore(&dsp->inflight_lock, flags);
+    return acquired;
+}
+
+/*
+ * Bounded spin before sleeping on credit_wq : the credit is returned by the IRQ,
+ * so a short spin avoids the wakeup latency when the DSP is about to finish.
+ */
+static bool dx_v3_dsp_slot_acquire_spin(dxdsp_t *dsp, dxrt_dsp_job_t *job)
+{
+    unsigned int spin_us = READ_ONCE(dispatch_spin_us);
+    ktime_t end;
+
+    if (dx_v3_dsp_slot_acquire(dsp, job))
+        return true;
+    if (spin_us == 0)
+        return false;
+    end = ktime_add_us(ktime_get(), spin_us);
+    do {
+        cpu_relax();
+        if (dx_v3_dsp_slot_acquire(dsp, job))
+            return true;
+    } while (ktime_before(ktime_get(), end));
+    return false;
+}
+
+/* Fail every request owned by the DSP (reset / recovery), one slot at a time */
+static void dx_v3_dsp_abort_inflight(dxdsp_t *dsp)
+{
+    dxrt_completion_t done;
+    struct dxdsp_inflight owner;
+    uint64_t now = ktime_get_ns();
+    unsigned long flags;
+
+    spin_lock_irqsave(&dsp->inflight_lock, flags);
+    while (dsp->inflight_num > 0)
+    {
+        owner = dsp->inflight_req[dsp->inflight_fifo[0]];
+        dx_v3_dsp_fill_completion(dsp, dsp->inflight_fifo[0], -ECANCELED, now, &done);
+        dx_v3_dsp_slot_release(dsp, 0);
+        spin_unlock_irqrestore(&dsp->inflight_lock, flags);
+        dxrt_job_complete(owner.ctx, owner.ucmd, &done);
+        spin_lock_irqsave(&dsp->inflight_lock, flags);
+    }
+    WRITE_DSP_STATUS(dsp->reg_dsp_base, 0x0);
+    spin_unlock_irqrestore(&dsp->inflight_lock, flags);
+    wake_up_interruptible(&dsp->credit_wq);
+}
+
+static bool dx_v3_dsp_should_stop(void)
+{
+    return (current->flags & PF_KTHREAD) && kthread_should_stop();
+}
+
+static irqreturn_t dsp_irq_handler(int irq, void *data)
+{
+    dxdsp_t *dsp = (dxdsp_t*)data;    
+    uint64_t irq_ns = ktime_get_ns();
+
+    pr_debug("dsp%d irq: %x\n", dsp->id, irq); // this log causes worse latency.
+
+    // IRQ status is checked and cleared by dx_v3_dsp_collect_done(), a hybrid poller may have reaped it already
+    dx_v3_dsp_reap(dsp, irq_ns);
 
 	return IRQ_HANDLED;
 }
+
+/*
+ * Hybrid polling : reap completions from process context without waiting for the IRQ.
+ * The mailbox IRQ status is checked, whatever the file polling : it completes the oldest slot.
+ * Returns the number of completed requests.
+ */
+int dx_v3_dsp_poll(dxdsp_t *dsp)
+{
+    /* nothing written to SRAM yet : no status to read, the IRQ cannot be for us */
+    if (READ_ONCE(dsp->inflight_num) == 0)
+        return 0;
+    return dx_v3_dsp_reap(dsp, ktime_get_ns());
+}
+
+/*
+ * Time to sleep before polling for the oldest in-flight request of 'ctx' :
+ * half of its expected remaining execution time (from the func_id history).
+ * Returns a negative value if the file has nothing in flight or there is no history.
+ */
+int64_t dx_v3_dsp_poll_delay(dxdsp_t *dsp, struct dxrt_file_ctx *ctx)
+{
+    int64_t delay = -1;
+    unsigned long flags;
+    uint32_t i;
+
+    spin_lock_irqsave(&dsp->inflight_lock, flags);
+    for (i = 0; i < dsp->inflight_num; i++)
+    {
+        struct dxdsp_inflight *rec = &dsp->inflight_req[dsp->inflight_fifo[i]];
+        uint64_t est;
+
+        if (rec->ctx != ctx)
+            continue;
+        est = READ_ONCE(dsp->exec_est_ns[rec->func_id % DSP_EXEC_EST_NUM]);
+        if (est && rec->dispatch_ns)
+            delay = max_t(int64_t, (int64_t)(rec->dispatch_ns + est - ktime_get_ns()) / 2, 0);
+        break;
+    }
+    spin_unlock_irqrestore(&dsp->inflight_lock, flags);
+    return delay;
+}
 static void dx_v3_dsp_irq_init(dxdsp_t *dsp)
 {  
     volatile void __iomem *reg_dsp_mailbox = dsp->reg_dsp_base_mailbox;
@@ -122,6 +317,8 @@ int dx_v3_dsp_reset_and_start(dxdsp_t *dsp)
 
     pr_debug("%s\n", __func__);
 
+    dx_v3_dsp_abort_inflight(dsp);
+
     //WRITE_DSP_RESET_CTRL(reg_dsp, 0xE0000000);//reset vector
     WRITE_DSP_RESET(reg_dsp_debug, 0x10000);
     udelay(1);
@@ -129,15 +326,9 @@ int dx_v3_dsp_reset_and_start(dxdsp_t *dsp)
     
     return 0;
 }
-int dx_v3_dsp_buf_init(void)
-{
-    pr_debug("%s\n", __func__);
-    memset(&g_dsp_memory_manager, 0, sizeof(g_dsp_memory_manager));
-
-    return 0;
-}
 int dx_v3_dsp_init(dxdsp_t *dsp)
 {
+    uint64_t t0 = ktime_get_ns();
     int ret;
 
     pr_debug("%s\n", __func__);
@@ -156,7 +347,8 @@ int dx_v3_dsp_init(dxdsp_t *dsp)
     if(!dsp->reg_dsp_base_debug_pwr)
     {
         pr_err("Failed to map dsp registers1\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto err_base;
     }
 
     // 2.DSP debug
@@ -164,47 +356,50 @@ int dx_v3_dsp_init(dxdsp_t *dsp)
     if(!dsp->reg_dsp_base_debug)
     {
         pr_err("Failed to map dsp registers2\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto err_debug_pwr;
     }
 
     // 3.DSP mailbox
-    dsp->reg_dsp_base_mailbox = ioremap(dsp->reg_dsp_base_phy_addr_mailbox, 0x100000);
+    dsp->reg_dsp_base_mailbox = ioremap(dsp->reg_dsp_base_phy_addr_mailbox, DSP_MAILBOX_MAP_SIZE);
     if(!dsp->reg_dsp_base_mailbox)
     {
         pr_err("Failed to map dsp registers3\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto err_debug;
     }
 
     // 4.DSP sram
-    dsp->reg_dsp_base_sram = ioremap(dsp->reg_dsp_base_phy_addr_sram, 0x40000);
+    dsp->reg_dsp_base_sram = ioremap(dsp->reg_dsp_base_phy_addr_sram, DSP_SRAM_SIZE);
     if(!dsp->reg_dsp_base_sram)
     {
         pr_err("Failed to map dsp registers4\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto err_mailbox;
     }
 	// 5.DSP rom & ram code
 	// don't use this range (Base + 0x0000_0000 : rom code, Base + 0x0010_0000 : ram code) 
 
-    // 6.dram    
-    dsp->reg_dsp_base_dram = ioremap(dsp->reg_dsp_base_phy_addr_dram, DSP_DRAM_SIZE);// = 0x1FE00000
-    if(!dsp->reg_dsp_base_dram)
-    {
-        pr_err("Failed to map dsp registers5\n");
-        return -ENOMEM;
-    }
+    // 6.dram : not mapped here, the kernel only touches it through the pool (dxrt_drv_mem.c), by chunks
 
-    dx_v3_dsp_buf_init();
-    
-    /* IRQ */
+    dsp->irq_event = 0;
+    init_waitqueue_head(&dsp->irq_wq);
+    spin_lock_init(&dsp->inflight_lock);
+    init_waitqueue_head(&dsp->credit_wq);
+    dsp->credits = dsp->pipeline_depth;
+    dsp->inflight = 0;
+    dsp->inflight_num = 0;
+    memset(dsp->exec_est_ns, 0, sizeof(dsp->exec_est_ns));
+    dsp->last_done_ns = 0;
+    //mutex_init(&dsp->run_lock);
+
+    /* IRQ : only once the inflight state its handler reaps is ready */
     ret = request_irq(dsp->irq_num, dsp_irq_handler, 0, "deepx-dsp", (void*)dsp);
     if(ret)
     {
         pr_err("Failed to request IRQ (DSP) %d.\n", dsp->irq_num);
-        return ret;
+        goto err_sram;
     }
-    dsp->irq_event = 0;
-    init_waitqueue_head(&dsp->irq_wq);
-    //mutex_init(&dsp->run_lock);
 
     dx_v3_dsp_irq_init(dsp);//interrupt enable
 
@@ -212,7 +407,8 @@ int dx_v3_dsp_init(dxdsp_t *dsp)
     dsp->dma_buf = dma_alloc_coherent(dsp->dev, dsp->dma_buf_size, &dsp->dma_buf_addr, GFP_KERNEL);
     if (!dsp->dma_buf) {
         pr_err("Failed to allocate dma_buf.\n");
-        return -1;
+        ret = -ENOMEM;
+        goto err_irq;
     }        
     pr_info("dma_buf : virt 0x%p, phys 0x%llx, virt_to_phys 0x%lx, size 0x%lx\n", 
         dsp->dma_buf, dsp->dma_buf_addr, virt_to_phys(dsp->dma_buf), dsp->dma_buf_size);
@@ -230,8 +426,23 @@ int dx_v3_dsp_init(dxdsp_t *dsp)
 	dx_v3_dsp_start(dsp);    
     
     pr_info("%s done!\n", __func__);
+    pr_debug("%s: registers mapped and DSP started in %llu us\n", __func__, div_u64(ktime_get_ns() - t0, 1000));
 
 	return 0;
+
+err_irq:
+    free_irq(dsp->irq_num, (void*)dsp);
+err_sram:
+    iounmap(dsp->reg_dsp_base_sram);
+err_mailbox:
+    iounmap(dsp->reg_dsp_base_mailbox);
+err_debug:
+    iounmap(dsp->reg_dsp_base_debug);
+err_debug_pwr:
+    iounmap(dsp->reg_dsp_base_debug_pwr);
+err_base:
+    iounmap(dsp->reg_dsp_base);
+    return ret;
 }
 int dx_v3_dsp_prepare_inference(dxdsp_t *dsp)
 {    
@@ -239,39 +450,113 @@ int dx_v3_dsp_prepare_inference(dxdsp_t *dsp)
     
     return 0;
 }
-int dx_v3_dsp_run(dxdsp_t *dsp, void *data)
-{	
-	volatile void __iomem *reg_dsp_base, *reg_dsp_sram;
-    dxrt_dsp_request_t *req = (dxrt_dsp_request_t*)data;	
-    pr_debug("%s: %d\n", __func__, req->req_id);
-    
-    // Acquire mutex to ensure only one thread can execute this function
-    //mutex_lock(&dsp->run_lock);
-    
-    reg_dsp_base = dsp->reg_dsp_base;
-    reg_dsp_sram = dsp->reg_dsp_base_sram;
 
-    //wait until DSP is available
-    while(READ_DSP_STATUS(reg_dsp_base)==0xFFAA);
-    WRITE_DSP_STATUS(reg_dsp_base, 0xFFAA);//dsp lock ==> this setting should be moved to upper line on V3A       
+static bool dx_v3_dsp_request_valid(dxrt_dsp_request_t *req)
+{
+    if (req->req_id >= DSP_MSG_SLOT_NUM || req->msg_header.message_size > sizeof(req->msg_data))
+    {
+        pr_debug("%s: invalid request %d (size %d)\n", __func__, req->req_id, req->msg_header.message_size);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Writes the message of an acquired slot to SRAM, the header last starts the DSP.
+ * The slot only joins inflight_fifo, which dx_v3_dsp_collect_done() scans, together with
+ * its header under inflight_lock.
+ */
+static void dx_v3_dsp_write_request(dxdsp_t *dsp, dxrt_dsp_request_t *req)
+{
+	volatile void __iomem *reg_dsp_sram = dsp->reg_dsp_base_sram;
+    unsigned long flags;
 
     dsp->req_id = req->req_id;
     //dx_v3_dsp_start(dsp);
     uint32_t *head_u32ptr = (uint32_t *)&req->msg_header; //8B
     uint32_t *data_u32ptr = (uint32_t *)&req->msg_data[0];//Max 52B
 
-    int32_t msg_buf_offset_4 = (MESSAGE_MAX_SIZE/4)*dsp->req_id;
+    int32_t msg_buf_offset_4 = (MESSAGE_MAX_SIZE/4)*req->req_id;
 
     // Data setting
     for(int i=0;i<req->msg_header.message_size/4;i++) WRITE_DSP_MSG_DATA (reg_dsp_sram, data_u32ptr[i], (msg_buf_offset_4+i));//Max 52B
     // Header setting and DSP start
+    spin_lock_irqsave(&dsp->inflight_lock, flags);
+    if (dsp->inflight_num == 0)
+        WRITE_DSP_STATUS(dsp->reg_dsp_base, 0xFFAA);//dsp lock
+    dsp->inflight_req[req->req_id].dispatch_ns = ktime_get_ns();
     for(int i=0;i<2;i++) WRITE_DSP_MSG_HEAD (reg_dsp_sram, head_u32ptr[i], (msg_buf_offset_4+i));//8B
+    dsp->inflight_fifo[dsp->inflight_num++] = req->req_id;
+    spin_unlock_irqrestore(&dsp->inflight_lock, flags);
         
     //WRITE_DSP_STATUS(reg_dsp_base, 0xFFAA);//dsp lock ==> this setting should be moved to upper line on V3A
+}
+
+int dx_v3_dsp_run(dxdsp_t *dsp, void *data)
+{	
+    dxrt_dsp_job_t *job = (dxrt_dsp_job_t*)data;
+    dxrt_dsp_request_t *req = &job->request;
+    pr_debug("%s: %d\n", __func__, req->req_id);
     
-    // Release mutex after operation is complete
-   // mutex_unlock(&dsp->run_lock);
-    
+    if (!dx_v3_dsp_request_valid(req))
+        return -EINVAL;
+
+    //wait for a credit and for the message slot of this req_id (DSP idle in serial mode)
+    if (!dx_v3_dsp_slot_acquire_spin(dsp, job))
+    {
+        bool acquired = false;
+        int ret;
+        ret = wait_event_interruptible(dsp->credit_wq,
+            (acquired = dx_v3_dsp_slot_acquire(dsp, job)) || dx_v3_dsp_should_stop());
+        if (!acquired)
+            return ret ? ret : -EINTR;
+    }
+    dx_v3_dsp_write_request(dsp, req);
+    return 0;
+}
+
+static bool dx_v3_dsp_has_credit(dxdsp_t *dsp)
+{
+    return READ_ONCE(dsp->credits) > 0;
+}
+
+/*
+ * Waits until a credit is free (spinning first, as dx_v3_dsp_run()), so that the
+ * request handler picks its next request when it can be sent and not before :
+ * requests arriving during the wait still compete for the pick.
+ * Returns 0, or -EINTR if the request handler is stopped.
+ */
+int dx_v3_dsp_wait_credit(dxdsp_t *dsp)
+{
+    unsigned int spin_us = READ_ONCE(dispatch_spin_us);
+    ktime_t end;
+
+    if (dx_v3_dsp_has_credit(dsp))
+        return 0;
+    if (spin_us)
+    {
+        end = ktime_add_us(ktime_get(), spin_us);
+        do {
+            cpu_relax();
+            if (dx_v3_dsp_has_credit(dsp))
+                return 0;
+        } while (ktime_before(ktime_get(), end));
+    }
+    wait_event_interruptible(dsp->credit_wq, dx_v3_dsp_has_credit(dsp) || dx_v3_dsp_should_stop());
+    return dx_v3_dsp_has_credit(dsp) ? 0 : -EINTR;
+}
+
+/* As dx_v3_dsp_run(), but -EBUSY instead of waiting when no message slot is free */
+int dx_v3_dsp_try_run(dxdsp_t *dsp, void *data)
+{
+    dxrt_dsp_job_t *job = (dxrt_dsp_job_t*)data;
+    dxrt_dsp_request_t *req = &job->request;
+
+    if (!dx_v3_dsp_request_valid(req))
+        return -EINVAL;
+    if (!dx_v3_dsp_slot_acquire(dsp, job))
+        return -EBUSY;
+    dx_v3_dsp_write_request(dsp, req);
     return 0;
 }
 int dx_v3_dsp_reg_dump(dxdsp_t *dsp)
@@ -298,15 +583,14 @@ int dx_v3_dsp_deinit(dxdsp_t *dsp)
     disable_irq(dsp->irq_num);
     synchronize_irq(dsp->irq_num);
     free_irq(dsp->irq_num, (void*)dsp);
+    /* no IRQ will complete them : drop the file references of the requests still on the DSP */
+    dx_v3_dsp_abort_inflight(dsp);
 
     iounmap(dsp->reg_dsp_base);
     iounmap(dsp->reg_dsp_base_debug_pwr);
     iounmap(dsp->reg_dsp_base_debug);
     iounmap(dsp->reg_dsp_base_mailbox);
     iounmap(dsp->reg_dsp_base_sram);
-    iounmap(dsp->reg_dsp_base_dram);
-
-    dx_v3_dsp_buf_init();
 
     //dx_v3_dsp_clock_disable(dsp);// TODO
 
@@ -0,0 +1,502 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/slab.h>
+#include <linux/genalloc.h>
+#include <linux/xarray.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
+#include <linux/io.h>
+#include <linux/vmalloc.h>
+#ifdef CONFIG_ARM64
+#include <asm/cputype.h>
+#include <asm/barrier.h>
+#endif
+#include "dxrt_drv.h"
+
+/*
+ * Protects the link of the buffers to their pool : the last reference of an exported
+ * buffer can be dropped after the device (and the pool embedded in it) is gone.
+ */
+static DEFINE_MUTEX(dxrt_dram_live_lock);
+
+/*
+ * DSP DRAM allocator.
+ * The pool covers the physical DRAM window (so that address 0 is never returned
+ * by gen_pool), buffers are handed out as offsets from the window base.
+ */
+int dxrt_dram_pool_init(dxrt_dram_pool_t *mem, phys_addr_t base, size_t size)
+{
+    void *wb;
+    int ret;
+
+    if (size > DSP_DRAM_SIZE)
+        return -EINVAL;
+
+    mem->pool = gen_pool_create(PAGE_SHIFT, -1);
+    if (!mem->pool)
+        return -ENOMEM;
+    ret = gen_pool_add(mem->pool, base, size, -1);
+    if (ret)
+    {
+        gen_pool_destroy(mem->pool);
+        mem->pool = NULL;
+        return ret;
+    }
+    mem->base = base;
+    mem->size = size;
+    /*
+     * The write-back alias is only used for cache maintenance and only exists during it
+     * (dxrt_dram_cache_sync()) : only check here that it can be made.
+     */
+    wb = IS_ENABLED(CONFIG_ARM64) ? memremap(base, PAGE_SIZE, MEMREMAP_WB) : NULL;
+    mem->cacheable = wb != NULL;
+    if (wb)
+        memunmap(wb);
+    else
+        pr_warn("%s: no cacheable alias of [%llx, +%zx], DXRT_MMAP_DRAM_CACHED is unavailable\n",
+            __func__, (uint64_t)base, size);
+    mutex_init(&mem->lock);
+    xa_init(&mem->bufs);
+    INIT_LIST_HEAD(&mem->live);
+    mem->num_bufs = 0;
+    mem->alloc_count = 0;
+    mem->alloc_fail = 0;
+    mem->alloc_ns_total = 0;
+    mem->alloc_ns_max = 0;
+    pr_debug("%s: [%llx, +%zx]\n", __func__, (uint64_t)base, size);
+    return 0;
+}
+
+static void dxrt_dram_buf_release(dxrt_dram_pool_t *mem, dxrt_dram_buf_t *b);
+
+void dxrt_dram_pool_deinit(dxrt_dram_pool_t *mem)
+{
+    dxrt_dram_buf_t *b, *next;
+    unsigned long idx;
+
+    if (!mem->pool)
+        return;
+    mutex_lock(&mem->lock);
+    xa_for_each(&mem->bufs, idx, b)
+    {
+        dxrt_dram_buf_release(mem, b);
+    }
+    xa_destroy(&mem->bufs);
+    mutex_unlock(&mem->lock);
+    /* buffers still exported : detach them, their last dma-buf reference only frees them */
+    mutex_lock(&dxrt_dram_live_lock);
+    list_for_each_entry_safe(b, next, &mem->live, live)
+    {
+        pr_debug("%s: offset 0x%x still exported\n", __func__, b->offset);
+        gen_pool_free(mem->pool, mem->base + b->offset, b->size);
+        list_del_init(&b->live);
+        WRITE_ONCE(b->mem, NULL);
+    }
+    mutex_unlock(&dxrt_dram_live_lock);
+    gen_pool_destroy(mem->pool);
+    mem->pool = NULL;
+}
+
+/* Returns 0 and fills @meta, -EINVAL for a bad alignment, -ENOMEM if no free range fits */
+int dxrt_dram_alloc(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx, uint32_t size, uint32_t align,
+    dxrt_dsp_buffer_metadata_t *meta)
+{
+    struct genpool_data_align data;
+    dxrt_dram_buf_t *b;
+    unsigned long addr;
+    uint64_t t0 = ktime_get_ns(), dt;
+    int ret;
+
+    if (size == 0)
+        size = DSP_BUFFER_UNIT_SIZE;
+    if (align == 0)
+        align = PAGE_SIZE;
+    if (!is_power_of_2(align) || size > mem->size)
+        return -EINVAL;
+    size = PAGE_ALIGN(size);
+    data.align = max_t(uint32_t, align, PAGE_SIZE);
+
+    b = kzalloc(sizeof(*b), GFP_KERNEL);
+    if (!b)
+        return -ENOMEM;
+
+    mutex_lock(&mem->lock);
+    addr = gen_pool_alloc_algo(mem->pool, size, gen_pool_first_fit_align, &data);
+    if (!addr)
+    {
+        mem->alloc_fail++;
+        mutex_unlock(&mem->lock);
+        kfree(b);
+        return -ENOMEM;
+    }
+    kref_init(&b->ref);
+    b->mem = mem;
+    b->owner = ctx;
+    b->offset = addr - mem->base;
+    b->size = size;
+    ret = xa_err(xa_store(&mem->bufs, b->offset >> PAGE_SHIFT, b, GFP_KERNEL));
+    if (ret)
+    {
+        gen_pool_free(mem->pool, addr, size);
+        mem->alloc_fail++;
+        mutex_unlock(&mem->lock);
+        kfree(b);
+        return ret;
+    }
+    list_add_tail(&b->list, &ctx->bufs);
+    mutex_lock(&dxrt_dram_live_lock);
+    list_add_tail(&b->live, &mem->live);
+    mutex_unlock(&dxrt_dram_live_lock);
+    mem->num_bufs++;
+    dt = ktime_get_ns() - t0;
+    mem->alloc_count++;
+    mem->alloc_ns_total += dt;
+    mem->alloc_ns_max = max(mem->alloc_ns_max, dt);
+    mutex_unlock(&mem->lock);
+
+    meta->dsp_buf_offset = b->offset;
+    meta->alloc_size = b->size;
+    return 0;
+}
+
+/* Called with dxrt_dram_live_lock held by kref_put_mutex() */
+static void dxrt_dram_buf_destroy(struct kref *ref)
+{
+    dxrt_dram_buf_t *b = container_of(ref, dxrt_dram_buf_t, ref);
+
+    if (b->mem)
+    {
+        gen_pool_free(b->mem->pool, b->mem->base + b->offset, b->size);
+        list_del(&b->live);
+    }
+    mutex_unlock(&dxrt_dram_live_lock);
+    kfree(b);
+}
+
+/* May be the last reference of an exported buffer, after its device is removed */
+void dxrt_dram_buf_put(dxrt_dram_buf_t *b)
+{
+    kref_put_mutex(&b->ref, dxrt_dram_buf_destroy, &dxrt_dram_live_lock);
+}
+
+/* Reference to the live buffer starting at @offset, NULL if there is none */
+dxrt_dram_buf_t *dxrt_dram_buf_get(dxrt_dram_pool_t *mem, uint32_t offset)
+{
+    dxrt_dram_buf_t *b;
+
+    if (offset & ~PAGE_MASK)
+        return NULL;
+    mutex_lock(&mem->lock);
+    b = xa_load(&mem->bufs, offset >> PAGE_SHIFT);
+    if (b)
+        kref_get(&b->ref);
+    mutex_unlock(&mem->lock);
+    return b;
+}
+
+/* Unlink from the pool and the owner, the range is freed with the last reference */
+static void dxrt_dram_buf_release(dxrt_dram_pool_t *mem, dxrt_dram_buf_t *b)
+{
+    xa_erase(&mem->bufs, b->offset >> PAGE_SHIFT);
+    list_del(&b->list);
+    dxrt_dram_zap(b->owner, mem->base + b->offset, b->size);
+    mem->num_bufs--;
+    dxrt_dram_buf_put(b);
+}
+
+/* Returns 0, or -EINVAL if no buffer of @ctx starts at @offset */
+int dxrt_dram_free(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx, uint32_t offset)
+{
+    dxrt_dram_buf_t *b;
+
+    if (offset & ~PAGE_MASK)
+        return -EINVAL;
+    mutex_lock(&mem->lock);
+    b = xa_load(&mem->bufs, offset >> PAGE_SHIFT);
+    if (!b || b->owner != ctx)
+    {
+        mutex_unlock(&mem->lock);
+        return -EINVAL;
+    }
+    dxrt_dram_buf_release(mem, b);
+    mutex_unlock(&mem->lock);
+    return 0;
+}
+
+/* [offset, offset + size) lies in one buffer of @ctx, caller holds mem->lock */
+bool dxrt_dram_owned(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx, uint64_t offset, uint64_t size)
+{
+    dxrt_dram_buf_t *b;
+
+    lockdep_assert_held(&mem->lock);
+    list_for_each_entry(b, &ctx->bufs, list)
+    {
+        if (offset >= b->offset && offset + size <= (uint64_t)b->offset + b->size)
+            return true;
+    }
+    return false;
+}
+
+/* Frees every buffer still owned by a closing file */
+void dxrt_dram_release_ctx(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx)
+{
+    dxrt_dram_buf_t *b, *tmp;
+
+    if (!mem->pool)
+        return;
+    mutex_lock(&mem->lock);
+    list_for_each_entry_safe(b, tmp, &ctx->bufs, list)
+    {
+        pr_debug("%s: pid %d leaked buffer 0x%x (0x%x)\n", __func__, ctx->pid, b->offset, b->size);
+        dxrt_dram_buf_release(mem, b);
+    }
+    mutex_unlock(&mem->lock);
+}
+
+/*
+ * Data cache maintenance of [start, end) by VA, to the point of coherency.
+ * The kernel's dcache_*_poc() are not exported to modules (and were renamed in 5.15),
+ * so the loop is done here. Clean is done as clean + invalidate, which the cores with
+ * a "dc cvac" erratum need anyway. Lines only partly inside an invalidate are cleaned
+ * too, not to drop the bytes outside of the range. Only called when mem->cacheable (arm64).
+ */
+static void dxrt_dcache_op(unsigned long start, unsigned long end, uint32_t op)
+{
+#ifdef CONFIG_ARM64
+    /* CTR_EL0.DminLine : log2 of the smallest D-cache line, in words */
+    unsigned long line = 4UL << ((read_cpuid_cachetype() >> 16) & 0xf);
+    unsigned long addr;
+
+    for (addr = start & ~(line - 1); addr < end; addr += line)
+    {
+        if (op == DX_CACHE_BEGIN_CPU_READ && addr >= start && addr + line <= end)
+            asm volatile("dc ivac, %0" : : "r" (addr) : "memory");
+        else
+            asm volatile("dc civac, %0" : : "r" (addr) : "memory");
+    }
+    dsb(sy);
+#endif
+}
+
+/*
+ * Cache maintenance of [offset, offset + size) for the cacheable user mapping.
+ * The data cache is physically tagged, so maintenance by VA on a write-back kernel
+ * alias also covers the lines allocated through the user mapping. The alias is made
+ * by chunks for the maintenance only : a persistent one would stay next to the
+ * uncached and write-combining mappings of the same DRAM, which arm64 does not allow.
+ * The range must lie in one buffer of @ctx : an invalidate would drop the dirty
+ * lines of another file. mem->lock keeps the buffer allocated until the end.
+ */
+int dxrt_dram_cache_sync(dxrt_dram_pool_t *mem, struct dxrt_file_ctx *ctx, uint32_t offset, uint32_t size,
+    uint32_t op)
+{
+    unsigned long start;
+    uint32_t len, page_off;
+    void *wb;
+    int ret = 0;
+
+    if (!mem->cacheable)
+        return -EOPNOTSUPP;
+    if (size == 0 || offset >= mem->size || size > mem->size - offset)
+        return -EINVAL;
+    if (op != DX_CACHE_BEGIN_CPU_READ && op != DX_CACHE_END_CPU_WRITE && op != DX_CACHE_FLUSH)
+        return -EINVAL;
+    mutex_lock(&mem->lock);
+    if (!dxrt_dram_owned(mem, ctx, offset, size))
+        ret = -EINVAL;
+    while (ret == 0 && size)
+    {
+        page_off = offset & ~PAGE_MASK;
+        len = min_t(uint32_t, size, DXRT_DRAM_CHUNK_SIZE - page_off);
+        wb = memremap(mem->base + offset - page_off, PAGE_ALIGN(page_off + len), MEMREMAP_WB);
+        if (!wb)
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        start = (unsigned long)wb + page_off;
+        dxrt_dcache_op(start, start + len, op);
+        memunmap(wb);
+        offset += len;
+        size -= len;
+    }
+    mutex_unlock(&mem->lock);
+    return ret;
+}
+
+/* Largest free range, from the allocation bitmap of each chunk */
+static size_t dxrt_dram_largest_free(struct gen_pool *pool)
+{
+    struct gen_pool_chunk *chunk;
+    unsigned long nbits, start, end;
+    size_t largest = 0;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(chunk, &pool->chunks, next_chunk)
+    {
+        nbits = (chunk->end_addr - chunk->start_addr + 1) >> pool->min_alloc_order;
+        start = find_next_zero_bit(chunk->bits, nbits, 0);
+        while (start < nbits)
+        {
+            end = find_next_bit(chunk->bits, nbits, start);
+            largest = max_t(size_t, largest, (size_t)(end - start) << pool->min_alloc_order);
+            start = find_next_zero_bit(chunk->bits, nbits, end);
+        }
+    }
+    rcu_read_unlock();
+    return largest;
+}
+
+/*
+ * size / avail / largest free range in bytes,
+ * frag = 100 * (1 - largest / avail) : 0 when all free space is contiguous
+ */
+ssize_t dxrt_dram_pool_show(dxrt_dram_pool_t *mem, char *buf)
+{
+    size_t avail, largest;
+    uint64_t count, avg;
+    ssize_t len;
+
+    if (!mem->pool)
+        return -ENODEV;
+    mutex_lock(&mem->lock);
+    avail = gen_pool_avail(mem->pool);
+    largest = dxrt_dram_largest_free(mem->pool);
+    count = mem->alloc_count;
+    avg = count ? div64_u64(mem->alloc_ns_total, count) : 0;
+    len = sysfs_emit(buf, "size %zu avail %zu largest %zu frag %llu%% buffers %u\n"
+        "allocs %llu fails %llu lat_avg_ns %llu lat_max_ns %llu\n",
+        mem->size, avail, largest,
+        avail ? 100 - div64_u64((uint64_t)largest * 100, avail) : 0, mem->num_bufs,
+        count, mem->alloc_fail, avg, mem->alloc_ns_max);
+    mutex_unlock(&mem->lock);
+    return len;
+}
+
+/* Upload benchmark : VGA, 720p, 1080p and 4K RGB frames */
+static const uint32_t dxrt_bench_frames[] = {
+    640 * 480 * 3, 1280 * 720 * 3, 1920 * 1080 * 3, 3840 * 2160 * 3,
+};
+#define DXRT_BENCH_ITERS    4
+
+/* bytes per us = MB/s */
+static uint64_t dxrt_bench_mbps(uint64_t bytes, uint64_t ns)
+{
+    return ns ? div64_u64(bytes * 1000, ns) : 0;
+}
+
+enum {
+    DXRT_BENCH_UC,
+    DXRT_BENCH_WC,
+    DXRT_BENCH_WB,
+    DXRT_BENCH_NUM,
+};
+
+/* ns to copy DXRT_BENCH_ITERS times each frame to @addr, mapped with the attribute @type */
+static int dxrt_bench_run(phys_addr_t addr, size_t size, const void *src, int type, uint64_t *ns)
+{
+    void __iomem *io = NULL;
+    void *wb = NULL;
+    uint64_t t0;
+    int i, n;
+
+    if (type == DXRT_BENCH_WB)
+        wb = memremap(addr, size, MEMREMAP_WB);
+    else
+        io = type == DXRT_BENCH_WC ? ioremap_wc(addr, size) : ioremap(addr, size);
+    if (!io && !wb)
+        return -ENOMEM;
+    for (i = 0; i < ARRAY_SIZE(dxrt_bench_frames); i++)
+    {
+        uint32_t frame = dxrt_bench_frames[i];
+
+        t0 = ktime_get_ns();
+        for (n = 0; n < DXRT_BENCH_ITERS; n++)
+        {
+            if (wb)
+            {
+                memcpy(wb, src, frame);
+                dxrt_dcache_op((unsigned long)wb, (unsigned long)wb + frame, DX_CACHE_END_CPU_WRITE);
+            }
+            else
+                memcpy_toio(io, src, frame);
+        }
+        wmb();
+        ns[i] = ktime_get_ns() - t0;
+    }
+    if (wb)
+    {
+        /* no line of this alias may stay in the cache once it is gone */
+        dxrt_dcache_op((unsigned long)wb, (unsigned long)wb + size, DX_CACHE_FLUSH);
+        memunmap(wb);
+    }
+    else
+        iounmap(io);
+    return 0;
+}
+
+/*
+ * CPU -> DRAM bandwidth of a frame copy through each mapping type offered by mmap() :
+ * uncached (DXRT_MMAP_DRAM), write-combining (DXRT_MMAP_DRAM_WC) and, when the DRAM
+ * can be mapped write-back, cacheable + clean (DXRT_MMAP_DRAM_CACHED, DX_CACHE_END_CPU_WRITE).
+ * The copies go to a scratch buffer allocated from the pool like any other, owned by
+ * a context of its own, never to a live buffer.
+ * The range is mapped with one attribute at a time : aliases with mismatched
+ * attributes are not allowed on arm64.
+ */
+ssize_t dxrt_dram_upload_bench(dxrt_dram_pool_t *mem, char *buf)
+{
+    size_t size = PAGE_ALIGN(dxrt_bench_frames[ARRAY_SIZE(dxrt_bench_frames) - 1]);
+    uint64_t ns[DXRT_BENCH_NUM][ARRAY_SIZE(dxrt_bench_frames)], bytes;
+    int num = mem->cacheable ? DXRT_BENCH_NUM : DXRT_BENCH_WB;
+    dxrt_dsp_buffer_metadata_t meta;
+    struct dxrt_file_ctx *owner;
+    ssize_t len = 0;
+    void *src;
+    int i, ret;
+
+    if (!mem->pool)
+        return -ENODEV;
+    /* only its buffer list is used : no mapping to zap on free */
+    owner = kzalloc(sizeof(*owner), GFP_KERNEL);
+    if (!owner)
+        return -ENOMEM;
+    INIT_LIST_HEAD(&owner->bufs);
+    ret = dxrt_dram_alloc(mem, owner, size, PAGE_SIZE, &meta);
+    if (ret)
+    {
+        kfree(owner);
+        return ret == -ENOMEM ? -EBUSY : ret;
+    }
+    src = vmalloc(size);
+    if (!src)
+        ret = -ENOMEM;
+    else
+        memset(src, 0x5a, size);
+    for (i = 0; i < num && ret == 0; i++)
+        ret = dxrt_bench_run(mem->base + meta.dsp_buf_offset, size, src, i, ns[i]);
+    vfree(src);
+    dxrt_dram_free(mem, owner, meta.dsp_buf_offset);
+    kfree(owner);
+    if (ret)
+        return ret;
+
+    for (i = 0; i < ARRAY_SIZE(dxrt_bench_frames); i++)
+    {
+        bytes = (uint64_t)dxrt_bench_frames[i] * DXRT_BENCH_ITERS;
+        len += sysfs_emit_at(buf, len, "frame %u uncached %llu wc %llu",
+            dxrt_bench_frames[i], dxrt_bench_mbps(bytes, ns[DXRT_BENCH_UC][i]),
+            dxrt_bench_mbps(bytes, ns[DXRT_BENCH_WC][i]));
+        if (mem->cacheable)
+            len += sysfs_emit_at(buf, len, " cached_sync %llu", dxrt_bench_mbps(bytes, ns[DXRT_BENCH_WB][i]));
+        len += sysfs_emit_at(buf, len, " MB/s\n");
+    }
+    return len;
+}
@@ -6,10 +6,17 @@
  *
  */
 
-#include <asm/cacheflush.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/moduleparam.h>
+#include <linux/capability.h>
 #include "dxrt_drv.h"
 #include "dxrt_version.h"
 
+static unsigned int hybrid_poll_max_us = 100;
+module_param(hybrid_poll_max_us, uint, 0644);
+MODULE_PARM_DESC(hybrid_poll_max_us, "Hybrid polling : max busy-poll time before falling back to the IRQ wait");
+
 /*
 * Initialization function to drive the device
 */
@@ -32,7 +39,7 @@ void dxrt_device_init(struct dxdev* dev)
  *        -ETIMEDOUT if an error occurs during waiting from response of deepx device
  *        -ENOMEM    if an error occurs during memory allocation on kernel space
  */
-static int dxrt_msg_general(struct dxdev *dev, dxrt_message_t *msg)
+static int dxrt_msg_general(struct dxdev *dev, dxrt_message_t *msg, struct dxrt_file_ctx *ctx)
 {
     int ret = 0;//, num = dev->id;
     pr_debug("%s: %d, %d: %llx %d\n", __func__, dev->id, dev->type, (uint64_t)msg->data, msg->size);
@@ -54,24 +61,18 @@ static int dxrt_msg_general(struct dxdev *dev, dxrt_message_t *msg)
  *        -ENOMEM    if an error occurs during memory allocation on kernel space
  *        -ECOMM     if an error occurs because of pcie data transaction fail
  */
-static int dxrt_identify_device(struct dxdev* dev, dxrt_message_t *msg)
+static int dxrt_identify_device(struct dxdev* dev, dxrt_message_t *msg, struct dxrt_file_ctx *ctx)
 {
     int ret = 0, num = dev->id;
     dxrt_device_info_t info;
     pr_debug("%s: %d, %d: %llx, %d\n", __func__, dev->id, dev->type, (uint64_t)msg->data, msg->size);
     info.type = dev->type;
     info.variant = dev->variant;
-    memset(&dev->response, 0, sizeof(dxrt_response_t));
+    memset(&ctx->response, 0, sizeof(dxrt_response_t));
    
-    {
-        dxrt_response_list_t *entry, *tmp;
-        spin_lock(&dev->responses_lock);
-        list_for_each_entry_safe(entry, tmp, &dev->responses.list, list) {
-            list_del(&entry->list);
-            kfree(entry);
-        }
-        spin_unlock(&dev->responses_lock);
-    }
+    /* stale completions only : requests still in flight keep their records */
+    if (atomic64_read(&ctx->submitted) == atomic64_read(&ctx->completed))
+        dxrt_completion_ring_reset(&ctx->completions);
     dev->mem_addr = dev->dsp->reg_dsp_base_phy_addr_dram;//dev->dsp->dma_buf_addr
     dev->mem_size = DSP_DRAM_SIZE;//dev->dsp->dma_buf_size
     dev->num_dma_ch = 1;
@@ -81,7 +82,7 @@ static int dxrt_identify_device(struct dxdev* dev, dxrt_message_t *msg)
     info.mem_size = dev->dsp->dma_buf_size;
 #else//use user defined dram address	
     info.mem_addr = dev->dsp->reg_dsp_base_phy_addr_dram;
-    info.mem_size = DSP_BUFFER_UNIT_SIZE*DSP_BUFFER_MAX_NUM;
+    info.mem_size = dev->mem.size;
 #endif	
     info.num_dma_ch = 1;
     pr_debug("%d: %s: [%llx, %llx], %d\n", num, __func__,
@@ -99,47 +100,69 @@ static int dxrt_identify_device(struct dxdev* dev, dxrt_message_t *msg)
 }
 
 /**
- * dxrt_schedule - Send scheduler datas to the dxrt device
+ * dxrt_schedule - Set the priority class and deadline of the requests of this file
  * @dev: The deepx device on kernel structure
- * @msg: User-space pointer including the data buffer
+ * @msg: data = dxrt_sched_t (DX_SCHED_ADD), sub_cmd = dxrt_sche_sub_cmd_t
+ * @ctx: The file context
  *
- * This function copies it to the user-space buffer provided by the ioctl command.
+ * DX_SCHED_ADD moves the requests submitted afterwards on this file to the class
+ * queue arg.prio, each with the deadline arg.deadline_us after its submission unless
+ * the request brings its own (dxrt_dsp_batch_entry_t.deadline_us).
+ * DX_SCHED_DELETE restores DX_SCHED_PRIO_NORMAL without deadline, and the default weight.
+ * arg.weight sets the share of DSP time of this file against the other files of the same
+ * class (DX_SCHED_WEIGHT_DEFAULT unless the cgroup of the opener has one).
+ * Requests already queued keep their class.
  *
  * Return: 0 on success,
  *        -EFAULT   if an error occurs during the copy(user <-> kernel)
- *        -ENOMEM   if an error occurs as memory allocation fail
- *                  This return is only for sub command of 'DX_SCHED_ADD'
- *        -EBUSY    There are no queues to assign to the user.
- *                  User scheduler options need modification.
+ *        -EPERM    if DX_SCHED_PRIO_RT is asked without CAP_SYS_NICE
  *                  This return is only for sub command of 'DX_SCHED_ADD'
- *        -ENOENT   There are no matching queues in the list.
+ *        -ENOENT   if DX_SCHED_ADD was not done on this file
  *                  This return is only for sub command of 'DX_SCHED_DELETE'
- *        -EINVAL   if an error occurs as sub-command is not supported
- *        -ETIMEDOUT if an error occurs during waiting from response of deepx device
+ *        -EINVAL   if an error occurs as sub-command, class or weight is not supported
  */
-static int dxrt_schedule(struct dxdev* dev, dxrt_message_t *msg)
+static int dxrt_schedule(struct dxdev* dev, dxrt_message_t *msg, struct dxrt_file_ctx *ctx)
 {
-    int ret = 0;//, num = dev->id;
-    
-    return ret;
+    dxrt_sched_t arg;
+
+    switch (msg->sub_cmd) {
+    case DX_SCHED_ADD:
+        if (msg->data == NULL)
+            return -EINVAL;
+        if (copy_from_user(&arg, (void __user*)msg->data, sizeof(arg)))
+            return -EFAULT;
+        if (arg.prio >= DX_SCHED_PRIO_NUM || arg.weight > DX_SCHED_WEIGHT_MAX)
+            return -EINVAL;
+        if (arg.prio == DX_SCHED_PRIO_RT && !capable(CAP_SYS_NICE))
+            return -EPERM;
+        pr_debug("%d: %s: %d prio %u deadline %u us weight %u\n", dev->id, __func__, ctx->pid,
+            arg.prio, arg.deadline_us, arg.weight);
+        WRITE_ONCE(ctx->sched_prio, arg.prio);
+        WRITE_ONCE(ctx->sched_deadline_us, arg.deadline_us);
+        if (arg.weight)
+            WRITE_ONCE(ctx->sched_weight, arg.weight);
+        ctx->sched_set = true;
+        return 0;
+    case DX_SCHED_DELETE:
+        if (!ctx->sched_set)
+            return -ENOENT;
+        WRITE_ONCE(ctx->sched_prio, DX_SCHED_PRIO_NORMAL);
+        WRITE_ONCE(ctx->sched_deadline_us, 0);
+        WRITE_ONCE(ctx->sched_weight, ctx->sched_cgroup_weight);
+        ctx->sched_set = false;
+        return 0;
+    default:
+        return -EINVAL;
+    }
 }
 
-/**
- * dxrt_write_mem - Write data to the dxrt device
- * @dev: The deepx device on kernel structure
- * @msg: User-space pointer including the data buffer
- *
- * This function copies it to the user-space buffer provided by the ioctl command.
- *
- * Return: 0 on success,
- *        -EFAULT    if an error occurs during the copy(user <-> kernel)
- *        -ECOMM     if an error occurs because of pcie data transaction fail
- */
-static int dxrt_write_mem(struct dxdev* dev, dxrt_message_t *msg)
+/* @owned : meminfo.ch is a staging buffer acquired by @ctx (DX_STAGING_WRITE / READ) */
+static int dxrt_write_mem_buf(struct dxdev* dev, dxrt_message_t *msg, struct dxrt_file_ctx *ctx, bool owned)
 {
     int ret = 0, num = dev->id;
     uint32_t ch;
     dxrt_req_meminfo_t meminfo;
+    void *buf;
     pr_debug("%d: %s\n", num, __func__);
     if (msg->data!=NULL)
     {
@@ -156,10 +179,6 @@ static int dxrt_write_mem(struct dxdev* dev, dxrt_message_t *msg)
             meminfo.offset,
             meminfo.size
         );
-        if (ch>2) {
-            pr_err( MODULE_NAME "%d: %s: invalid channel.\n", num, __func__);
-            return -EINVAL;
-        }
         if ( meminfo.base + meminfo.offset < dev->mem_addr ||
             meminfo.base + meminfo.offset + meminfo.size > dev->mem_addr + dev->mem_size )
         {
@@ -167,8 +186,18 @@ static int dxrt_write_mem(struct dxdev* dev, dxrt_message_t *msg)
                 meminfo.base, meminfo.offset, dev->mem_addr, dev->mem_size);
             return -EINVAL;
         }
-                
-        if (copy_from_user(dev->dsp->dma_buf + meminfo.offset, (void __user*)meminfo.data, meminfo.size)) {
+        /* DXRT_CMD_WRITE_MEM / READ_MEM : ch 0..2 are DMA channels, all on the shared buffer */
+        if (!owned && ch > 2) {
+            pr_debug( MODULE_NAME "%d: %s: invalid channel.\n", num, __func__);
+            return -EINVAL;
+        }
+        buf = dxrt_staging_buf(dev, ctx, owned ? ch : 0, meminfo.offset, meminfo.size);
+        if (!buf) {
+            pr_debug( MODULE_NAME "%d: %s: invalid staging buffer %u: %x + %x\n", num, __func__,
+                ch, meminfo.offset, meminfo.size);
+            return -EINVAL;
+        }
+        if (copy_from_user(buf, (void __user*)meminfo.data, meminfo.size)) {
             pr_debug("%d: %s: failed.\n", num, __func__);
             return -EFAULT;
         }
@@ -178,69 +207,173 @@ static int dxrt_write_mem(struct dxdev* dev, dxrt_message_t *msg)
     return ret;
 }
 
+static int dxrt_read_mem_buf(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx, bool owned)
+{
+    int num = dev->id;
+    uint32_t ch;
+    dxrt_req_meminfo_t meminfo;
+    void *buf;
+    pr_debug("%d: %s\n", num, __func__);
+    if (msg->data!=NULL) {
+        if (copy_from_user(&meminfo, (void __user*)msg->data, sizeof(meminfo))) {
+            pr_debug("%d: %s: failed.\n", num, __func__);
+            return -EFAULT;
+        }
+        ch = meminfo.ch;
+        pr_debug( MODULE_NAME "%d:%d %s: [%llx, %llx + %x(%x)]\n",
+            num, ch,
+            __func__,
+            meminfo.data,
+            meminfo.base,
+            meminfo.offset,
+            meminfo.size
+        );
+        if ( meminfo.base + meminfo.offset < dev->mem_addr ||
+            meminfo.base + meminfo.offset + meminfo.size > dev->mem_addr + dev->mem_size )
+        {
+            pr_debug("%d: %s: invalid address: %llx + %x\n", num, __func__, meminfo.base, meminfo.offset);
+            return -EINVAL;
+        }
+        /* DXRT_CMD_WRITE_MEM / READ_MEM : ch 0..2 are DMA channels, all on the shared buffer */
+        if (!owned && ch > 2) {
+            pr_debug( MODULE_NAME "%d: %s: invalid channel.\n", num, __func__);
+            return -EINVAL;
+        }
+        buf = dxrt_staging_buf(dev, ctx, owned ? ch : 0, meminfo.offset, meminfo.size);
+        if (!buf) {
+            pr_debug( MODULE_NAME "%d: %s: invalid staging buffer %u: %x + %x\n", num, __func__,
+                ch, meminfo.offset, meminfo.size);
+            return -EINVAL;
+        }
+        if (copy_to_user((void __user*)meminfo.data, buf, meminfo.size)) {
+            pr_debug("%d: %s: failed.\n", num, __func__);
+            return -EFAULT;
+        }        
+    }
+    return 0;
+}
+
 /**
- * dxrt_write_input 
- *  - Write input data to the dxrt device and model meta-datas insert queue
+ * dxrt_write_mem - Write data to the dxrt device
  * @dev: The deepx device on kernel structure
  * @msg: User-space pointer including the data buffer
  *
- * This function copies user datas to memory of deepx device by the ioctl command.
- * Model meta datas insert to queue via pcie if user datas copy to device successfully.
+ * This function copies it to the user-space buffer provided by the ioctl command.
+ * meminfo.ch is the DMA channel (0..2), all of them use the shared buffer.
+ * offset + size must fit in it.
+ *
+ * Return: 0 on success,
+ *        -EFAULT    if an error occurs during the copy(user <-> kernel)
+ *        -EINVAL    if an error occurs because of invalid address or channel
+ *        -ECOMM     if an error occurs because of pcie data transaction fail
+ */
+static int dxrt_write_mem(struct dxdev* dev, dxrt_message_t *msg, struct dxrt_file_ctx *ctx)
+{
+    return dxrt_write_mem_buf(dev, msg, ctx, false);
+}
+
+/**
+ * dxrt_write_input 
+ *  - Insert one DSP message to the request queue
+ * @dev: The deepx device on kernel structure
+ * @msg: User-space pointer including the data buffer (dxrt_dsp_request_t)
+ * @ctx: The file context which owns the request
+ *
+ * This function copies a DSP message from user space by the ioctl command and
+ * queues it like write() : through the scheduler, in the order of the file.
+ * The completion is reported on the completion queue of the file.
  *
  * Return: 0 on success,
  *        -EFAULT   if an error occurs during the copy(user <-> kernel)
- *        -EBUSY    if an error occurs inserting queue as the queue is full (retry) 
- *        -EINVAL   if an error occurs inserting queue as the queue is disable
- *                  if an error occurs as interrupt handshake is fail with device
- *                  if an error occurs as sub-command is not supported
- *        -ECOMM    if an error occurs because of pcie data transaction fail
- *        -ENOENT   There are no matching queues in the list.
+ *        -EINVAL   if the request id or the message size is invalid
+ *        -ENODEV   if the device is not running
+ *        -ERESTARTSYS if interrupted while waiting for queue space
  */
-static int dxrt_write_input(struct dxdev* dev, dxrt_message_t *msg)
+static int dxrt_write_input(struct dxdev* dev, dxrt_message_t *msg, struct dxrt_file_ctx *ctx)
 {
-    int ret = 0, num = dev->id;
+    int num = dev->id;
+    dxrt_dsp_job_t job;
     pr_debug("%d: %s\n", num, __func__);
-    
-    dxrt_request_t req;
-    if (msg->data!=NULL) {
-        if (copy_from_user(&req, (void __user*)msg->data, sizeof(req))) {
-            pr_debug("%d: %s: failed.\n", num, __func__);
-            return -EFAULT;
-        }
-        pr_debug( MODULE_NAME "%d: %s: req %d\n", 
-            num, __func__, req.req_id
-        );
-        dev->dsp->run(dev->dsp, &req);
-    }        
-    return ret;
-    
+
+    if (msg->data == NULL)
+        return 0;
+    if (copy_from_user(&job.request, (void __user*)msg->data, sizeof(job.request))) {
+        pr_debug("%d: %s: failed.\n", num, __func__);
+        return -EFAULT;
+    }
+    pr_debug( MODULE_NAME "%d: %s: req %d\n", num, __func__, job.request.req_id);
+    if (job.request.req_id >= DSP_MSG_SLOT_NUM ||
+        job.request.msg_header.message_size > sizeof(job.request.msg_data))
+        return -EINVAL;
+    job.ucmd = NULL;
+    job.deadline_ns = 0;
+    return dxrt_submit_jobs(ctx, &job, 1, false);
 }
 
 /**
  * dxrt_dsp_run_request 
- *  - Write model meta-datas insert queue
+ *  - Insert a batch of DSP messages to the request queue
  * @dev: The deepx device on kernel structure
- * @msg: User-space pointer including the data buffer
+ * @msg: User-space pointer including the data buffer (dxrt_dsp_batch_entry_t[]),
+ *       size in bytes, sub_cmd DX_BATCH_NONBLOCK
+ * @ctx: The file context which owns the requests
  *
- * This function copies user datas to memory of deepx device by the ioctl command.
- * Model meta datas insert to queue via pcie if user datas copy to device successfully.
+ * This function copies an array of DSP messages from user space by the ioctl command.
+ * Valid entries are inserted to the queue together with a single wakeup of the
+ * request handler. The status of every entry is written back to user space before
+ * the entries are queued, so that nothing is queued if the copy fails.
+ * Completions are reported per request on the completion queue of the file.
  *
- * Return: 0 on success,
+ * Return: number of queued entries on success,
  *        -EFAULT   if an error occurs during the copy(user <-> kernel)
- *        -EBUSY    if an error occurs inserting queue as the queue is full (retry) 
- *        -EINVAL   if an error occurs inserting queue as the queue is disable
- *                  if an error occurs as interrupt handshake is fail with device
- *                  if an error occurs as sub-command is not supported
- *        -ENOENT   There are no matching queues in the list.
+ *        -EINVAL   if the buffer size is not a multiple of the entry size or too large
+ *        -EAGAIN   if the queue is full and DX_BATCH_NONBLOCK is set (retry)
+ *        -ENOMEM   if an error occurs as memory allocation fail
  */
-static int dxrt_dsp_run_request(struct dxdev* dev, dxrt_message_t *msg)
+static int dxrt_dsp_run_request(struct dxdev* dev, dxrt_message_t *msg, struct dxrt_file_ctx *ctx)
 {
-    int ret = -1, num = dev->id;
-    pr_debug("%d: %s\n", num, __func__);
-        
-    /* TODO */
-    return ret;
-    
+    int ret = 0, num = dev->id;
+    uint32_t cnt = msg->size / sizeof(dxrt_dsp_batch_entry_t);
+    uint32_t i, queued = 0;
+    dxrt_dsp_batch_entry_t *entries;
+    dxrt_dsp_job_t *jobs;
+    pr_debug("%d: %s: %u entries\n", num, __func__, cnt);
+
+    if (msg->data == NULL || cnt == 0 || cnt > DXRT_REQUEST_BATCH_MAX ||
+        msg->size % sizeof(dxrt_dsp_batch_entry_t))
+        return -EINVAL;
+
+    entries = memdup_user((void __user*)msg->data, cnt * sizeof(dxrt_dsp_batch_entry_t));
+    if (IS_ERR(entries))
+        return PTR_ERR(entries);
+    jobs = kmalloc_array(cnt, sizeof(dxrt_dsp_job_t), GFP_KERNEL);
+    if (!jobs) {
+        kfree(entries);
+        return -ENOMEM;
+    }
+    for (i = 0; i < cnt; i++)
+    {
+        if (entries[i].request.req_id >= DSP_MSG_SLOT_NUM ||
+            entries[i].request.msg_header.message_size > sizeof(entries[i].request.msg_data)) {
+            pr_debug("%d: %s: entry %u invalid (req %u)\n", num, __func__, i, entries[i].request.req_id);
+            entries[i].status = -EINVAL;
+            continue;
+        }
+        entries[i].status = 0;
+        jobs[queued].ucmd = NULL;
+        jobs[queued].deadline_ns = (uint64_t)entries[i].deadline_us * NSEC_PER_USEC;
+        jobs[queued++].request = entries[i].request;
+    }
+    /* statuses first : once queued, the requests complete whatever is returned */
+    if (copy_to_user((void __user*)msg->data, entries, cnt * sizeof(dxrt_dsp_batch_entry_t))) {
+        pr_debug("%d: %s: copy failed.\n", num, __func__);
+        ret = -EFAULT;
+    } else if (queued > 0) {
+        ret = dxrt_submit_jobs(ctx, jobs, queued, msg->sub_cmd & DX_BATCH_NONBLOCK);
+    }
+    kfree(jobs);
+    kfree(entries);
+    return ret ? ret : queued;
 }
 
 
@@ -248,24 +381,66 @@ static int dxrt_dsp_run_request(struct dxdev* dev, dxrt_message_t *msg)
  * dxrt_dsp_run_response 
  *  - Pop device response data from queue
  * @dev: The deepx device on kernel structure
- * @msg: User-space pointer including the data buffer
+ * @msg: User-space pointer including the data buffer (dxrt_completion_t)
  *
- * This function copies data on deepx device memory to user buffer by the ioctl command.
- * If there is data in the internal response queue,
+ * This function copies the oldest completion record (response and timestamps)
+ * in the internal completion queue to user buffer by the ioctl command.
+ * It does not wait, every request completes with its own record.
  * 
  * Return: 0 on success,
  *        -EFAULT   if an error occurs during the copy(user <-> kernel)
- *        -ENODATA  if an error occurs inserting queue as the queue is full (retry)
- *        -EINVAL   if an error occurs because the pcie dma channel is not supported
+ *        -ENODATA  if there is no completion in the queue (retry)
+ *        -EINVAL   if the user buffer is not given
  */
-static int dxrt_dsp_run_response(struct dxdev* dev, dxrt_message_t *msg)
+static int dxrt_dsp_run_response(struct dxdev* dev, dxrt_message_t *msg, struct dxrt_file_ctx *ctx)
 {
     int num = dev->id;
+    dxrt_completion_t comp;
     pr_debug("%d: %s\n", num, __func__);
     
-    int ret = -1;
-    /* TODO */
-    return ret;    
+    if (msg->data == NULL)
+        return -EINVAL;
+    if (dxrt_completion_ring_pop(&ctx->completions, &comp))
+        return -ENODATA;
+    if (copy_to_user((void __user*)msg->data, &comp, sizeof(comp))) {
+        pr_err( MODULE_NAME "%d: %s: copy failed.\n", num, __func__);
+        return -EFAULT;
+    }
+    return 0;    
+}
+
+/*
+ * Hybrid polling : sleep for half of the expected execution time of the oldest
+ * in-flight request of this file, then poll the mailbox instead of waiting for
+ * the IRQ wakeup.
+ * Returns true if the file has a completion, false to fall back to the IRQ wait.
+ */
+static bool dxrt_hybrid_poll(struct dxdev* dev, struct dxrt_file_ctx *ctx)
+{
+    dxdsp_t *dsp = dev->dsp;
+    int64_t delay = dsp->poll_delay(dsp, ctx);
+    ktime_t end;
+
+    if (delay < 0)
+        return false;
+    if (delay > 0) {
+        ktime_t timeout = ns_to_ktime(delay);
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout(&timeout, HRTIMER_MODE_REL);
+    }
+    end = ktime_add_us(ktime_get(), READ_ONCE(hybrid_poll_max_us));
+    do {
+        dsp->poll(dsp);
+        if (!dxrt_completion_ring_empty(&ctx->completions)) {
+            atomic64_inc(&dev->poll_hit);
+            return true;
+        }
+        if (signal_pending(current) || atomic_read(&ctx->event))
+            break;
+        cpu_relax();
+    } while (ktime_before(ktime_get(), end));
+    atomic64_inc(&dev->poll_miss);
+    return false;
 }
 
 /**
@@ -277,7 +452,8 @@ static int dxrt_dsp_run_response(struct dxdev* dev, dxrt_message_t *msg)
  * This function copies data on deepx device memory to user buffer by the ioctl command.
  * If there is data in the internal response queue,
  * the data is read from the deepx device immediately.
- * Otherwise, it waits until the queue is not empty.
+ * Otherwise, it waits until the queue is not empty
+ * (with DX_POLL_HYBRID, it polls the device before sleeping on the IRQ).
  * 
  * Return: 0 on success,
  *        -EFAULT   if an error occurs during the copy(user <-> kernel)
@@ -285,42 +461,35 @@ static int dxrt_dsp_run_response(struct dxdev* dev, dxrt_message_t *msg)
  *        -EINVAL   if an error occurs because the pcie dma channel is not supported
  *        -ECOMM    if an error occurs because of pcie data transaction fail
  */
-static int dxrt_read_output(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_read_output(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int num = dev->id;
     pr_debug("%d: %s\n", num, __func__);
     
-    dxdsp_t *dsp = dev->dsp;
-    
     int ret = -1;
-    unsigned long flags;
+    dxrt_completion_t comp;
     if (msg->data!=NULL) {
-        if (list_empty(&dev->responses.list)) {
+        if (dxrt_completion_ring_empty(&ctx->completions) &&
+            !(READ_ONCE(ctx->poll_mode) == DX_POLL_HYBRID && dxrt_hybrid_poll(dev, ctx))) {
             pr_debug(MODULE_NAME "%d: %s: start to wait.\n", num, __func__);
-            ret = wait_event_interruptible(dsp->irq_wq, dsp->irq_event==1);
+            ret = wait_event_interruptible(ctx->wq,
+                !dxrt_completion_ring_empty(&ctx->completions) || atomic_read(&ctx->event) ||
+                READ_ONCE(dev->dead));
             pr_debug(MODULE_NAME "%d: %s: wake up.\n", num, __func__);
-            spin_lock_irqsave(&dsp->irq_event_lock, flags);
-            dsp->irq_event = 0;
-            spin_unlock_irqrestore(&dsp->irq_event_lock, flags);
+            atomic_set(&ctx->event, 0);
         }
 
-        spin_lock_irqsave(&dev->responses_lock, flags);
-        if (!list_empty(&dev->responses.list)) {
-            dxrt_response_list_t *entry = list_first_entry(&dev->responses.list, dxrt_response_list_t, list);
-            pr_debug(MODULE_NAME "%d: %s: %d\n", num, __func__, entry->response.req_id);
-            if (copy_to_user((void __user*)msg->data, &entry->response, sizeof(dxrt_response_t))) {
+        if (dxrt_completion_ring_pop(&ctx->completions, &comp) == 0) {
+            pr_debug(MODULE_NAME "%d: %s: %d\n", num, __func__, comp.response.req_id);
+            if (copy_to_user((void __user*)msg->data, &comp.response, sizeof(dxrt_response_t))) {
                 pr_err( MODULE_NAME "%d: %s: memcpy failed.\n", num, __func__);
                 return -EFAULT;
             }
-            list_del(&entry->list);
-            kfree(entry);
             ret = 0;
         } else {
             pr_debug(MODULE_NAME "%d: %s: empty\n", num, __func__);
             ret = -1;
         }
-        spin_unlock_irqrestore(&dev->responses_lock, flags);
-
     }
     return ret;    
 }
@@ -336,19 +505,17 @@ static int dxrt_read_output(struct dxdev* dev, dxrt_message_t* msg)
  * Return: 0 on success,
  *        Currently no other return values ​​are defined. 
  */
-static int dxrt_terminate(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_terminate(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int num = dev->id;
     pr_debug(MODULE_NAME "%d: %s\n", num, __func__);
     
-    dxdsp_t *dsp = dev->dsp;
     unsigned long flags;
     pr_debug(MODULE_NAME "%d: %s start \n", num, __func__);
-    spin_lock_irqsave(&dsp->irq_event_lock, flags);
 
-    dsp->irq_event = 1;
-    wake_up_interruptible(&dsp->irq_wq);
-    spin_unlock_irqrestore(&dsp->irq_event_lock, flags);
+    /* only the reader of this file is woken up */
+    atomic_set(&ctx->event, 1);
+    wake_up_interruptible(&ctx->wq);
     {
         spin_lock_irqsave(&dev->error_lock, flags);
         dev->error = 99;
@@ -365,103 +532,72 @@ static int dxrt_terminate(struct dxdev* dev, dxrt_message_t* msg)
  * @msg: User-space pointer including the data buffer
  *
  * This function copies data on deepx device memory to user buffer by the ioctl command
+ * meminfo.ch is the DMA channel as for dxrt_write_mem().
  *
  * Return: 0 on success,
  *        -EFAULT    if an error occurs during the copy(user <-> kernel)
- *        -EINVAL    if an error occurs because of invalid address from user
+ *        -EINVAL    if an error occurs because of invalid address or channel from user
  *        -ECOMM     if an error occurs because of pcie data transaction fail
  */
-static int dxrt_read_mem(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_read_mem(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
-    int num = dev->id;
-    uint32_t ch;
-    dxrt_req_meminfo_t meminfo;
-    pr_debug("%d: %s\n", num, __func__);
-    if (msg->data!=NULL) {
-        if (copy_from_user(&meminfo, (void __user*)msg->data, sizeof(meminfo))) {
-            pr_debug("%d: %s: failed.\n", num, __func__);
-            return -EFAULT;
-        }
-        ch = meminfo.ch;
-        pr_debug( MODULE_NAME "%d:%d %s: [%llx, %llx + %x(%x)]\n",
-            num, ch,
-            __func__,
-            meminfo.data,
-            meminfo.base,
-            meminfo.offset,
-            meminfo.size
-        );
-        if (ch>2) {
-            pr_err( MODULE_NAME "%d: %s: invalid channel.\n", num, __func__);
-            return -EINVAL;
-        }
-        if ( meminfo.base + meminfo.offset < dev->mem_addr ||
-            meminfo.base + meminfo.offset + meminfo.size > dev->mem_addr + dev->mem_size )
-        {
-            pr_debug("%d: %s: invalid address: %llx + %x\n", num, __func__, meminfo.base, meminfo.offset);
-            return -EINVAL;
-        }
-        
-        if (copy_to_user((void __user*)meminfo.data, dev->dsp->dma_buf + meminfo.offset,  meminfo.size)) {
-            pr_debug("%d: %s: failed.\n", num, __func__);
-            return -EFAULT;
-        }        
-    }
-    return 0;
+    return dxrt_read_mem_buf(dev, msg, ctx, false);
 }
 
 /**
- * dxrt_cpu_cache_flush - Execute cpu cache flush
+ * dxrt_cpu_cache_flush - CPU cache maintenance of the cacheable DRAM mapping
  * @dev: The deepx device on kernel structure
- * @msg: User-space pointer including the data buffer
+ * @msg: data = dxrt_meminfo_t, sub_cmd = dxrt_cache_sub_cmd_t
+ * @ctx: The file context
+ *
+ * For the DRAM mapped with DXRT_MMAP_DRAM_CACHED, [base + offset, + size) is
+ * invalidated before the CPU reads DSP output (DX_CACHE_BEGIN_CPU_READ),
+ * cleaned after the CPU wrote DSP input (DX_CACHE_END_CPU_WRITE), or both (DX_CACHE_FLUSH).
+ * The uncached DXRT_MMAP_DRAM mapping does not need it.
  *
- * This function is executed by the ioctl command
- * If you feel that copying data between master devices
- * causes a data inconsistency problem recognized by the CPU,
- * you can call the corresponding API.
- * 
  * Return: 0 on success,
  *        -EFAULT    if an error occurs during the copy(user <-> kernel)
  *        -EINVAL    if an error occurs because of invalid address from user
+ *                   if the range is not inside a buffer of this file
+ *                   if sub-command is not supported
+ *        -EOPNOTSUPP if the DRAM has no cacheable alias
  */
-static int dxrt_cpu_cache_flush(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_cpu_cache_flush(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int num = dev->id;
     dxrt_meminfo_t meminfo;
+    uint64_t addr;
     pr_debug("%d: %s: %llx\n", num, __func__, (uint64_t)msg->data);
     if (msg->data!=NULL) {
         if (copy_from_user(&meminfo, (void __user*)msg->data, sizeof(meminfo))) {
             pr_debug("%d: %s: failed.\n", num, __func__);
             return -EFAULT;
         }
-        pr_debug(MODULE_NAME "%d: %s: [%llx, %llx + %x(%x)]\n",
+        pr_debug(MODULE_NAME "%d: %s: %d [%llx + %x(%x)]\n",
             num,
             __func__,
-            meminfo.data,
+            msg->sub_cmd,
             meminfo.base,
             meminfo.offset,
             meminfo.size
         );
-        if ( meminfo.base + meminfo.offset < dev->mem_addr ||            
-            meminfo.base + meminfo.offset + meminfo.size > dev->mem_addr + dev->mem_size ) {
+        addr = meminfo.base + meminfo.offset;
+        if (addr < dev->mem.base || addr + meminfo.size > dev->mem.base + dev->mem.size) {
             pr_debug("%d: %s: invalid address: %llx + %x\n", num, __func__, meminfo.base, meminfo.offset);
             return -EINVAL;
         }
-
-        //flush_dcache_range(meminfo.data + meminfo.offset, meminfo.data + meminfo.offset + meminfo.size); 
-		//dcache_clean_poc(meminfo.data + meminfo.offset, meminfo.data + meminfo.offset + meminfo.size);
-		caches_clean_inval_pou(meminfo.data + meminfo.offset, meminfo.data + meminfo.offset + meminfo.size);//virtual address		
+        return dxrt_dram_cache_sync(&dev->mem, ctx, addr - dev->mem.base, meminfo.size, msg->sub_cmd);
     }
     return 0;
 }
-static int dxrt_soc_custom(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_soc_custom(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int ret = 0, num = dev->id;
     pr_info("%d: %s: %llx\n", num, __func__, (uint64_t)msg->data);
     
     return ret;
 }
-static int dxrt_get_log(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_get_log(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int ret = 0;//, num = dev->id;
     pr_debug("%s: %d, %d: %llx\n", __func__, dev->id, dev->type, (uint64_t)msg->data);
@@ -484,7 +620,7 @@ static int dxrt_get_log(struct dxdev* dev, dxrt_message_t* msg)
  *        -EFAULT    if an error occurs during the copy(user <-> kernel)
  *        -ENOMEM    if an error occurs during memory allocation on kernel space
 */
-static int dxrt_reset_device(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_reset_device(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int ret;    
 	struct dxdsp *dsp = dev->dsp;      
@@ -504,7 +640,7 @@ static int dxrt_reset_device(struct dxdev* dev, dxrt_message_t* msg)
  *        -EFAULT    if an error occurs during the copy(user <-> kernel)
  *        -EINVAL    if an error occurs because of unsupported command from user
 */
-static int dxrt_handle_rt_drv_info_sub(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_handle_rt_drv_info_sub(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int num = dev->id;
     int ret = 0;
@@ -546,7 +682,7 @@ static int dxrt_handle_rt_drv_info_sub(struct dxdev* dev, dxrt_message_t* msg)
  *        -ETIMEDOUT if an error occurs during waiting from response of deepx device
  *        -ENOMEM    if an error occurs during memory allocation on kernel space
  */
-static int dxrt_recovery_device(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_recovery_device(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int ret;    
 	struct dxdsp *dsp = dev->dsp;      
@@ -555,18 +691,28 @@ static int dxrt_recovery_device(struct dxdev* dev, dxrt_message_t* msg)
     return ret;
 }
 
-static int dxrt_handle_drv_info(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_handle_drv_info(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
-    return dxrt_handle_rt_drv_info_sub(dev, msg);
+    return dxrt_handle_rt_drv_info_sub(dev, msg, ctx);
 }
 
-static int dxrt_alloc_buf(struct dxdev* dev, dxrt_message_t* msg)
+/**
+ * dxrt_alloc_buf - Allocate a buffer in the DSP DRAM window
+ * @dev: The deepx device on kernel structure
+ * @msg: data = dxrt_dsp_buffer_metadata_t (alloc_size in, offset/size out),
+ *       sub_cmd = alignment in bytes (0 : page)
+ * @ctx: The file context, owner of the buffer (freed when the file is closed)
+ *
+ * Return: 0 on success,
+ *        -EFAULT   if an error occurs during the copy(user <-> kernel)
+ *        -EINVAL   if data is NULL or the alignment is not a power of 2
+ *        -ENOMEM   if no free range of the requested size is available
+ */
+static int dxrt_alloc_buf(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int num = dev->id;
     dxrt_dsp_buffer_metadata_t dsp_buf_meta;
-    int i;
-    int found = -1;
-    unsigned long flags;
+    int ret;
 
     pr_debug("%d: %s\n", num, __func__);
     
@@ -574,57 +720,35 @@ static int dxrt_alloc_buf(struct dxdev* dev, dxrt_message_t* msg)
         pr_err("%d: %s: data is NULL\n", num, __func__);
         return -EINVAL;
     }
-
-    // Lock the memory manager for thread-safe access
-    spin_lock_irqsave(&dev->dsp->irq_event_lock, flags);
-
-    // Find a free buffer slot
-    for (i = 0; i < DSP_BUFFER_MAX_NUM; i++) {
-        if (g_dsp_memory_manager.buffers[i].alloc_size == 0) {
-            found = i;
-            break;
-        }
+    if (copy_from_user(&dsp_buf_meta, (void __user*)msg->data, sizeof(dsp_buf_meta))) {
+        pr_err("%d: %s: copy_from_user failed.\n", num, __func__);
+        return -EFAULT;
     }
 
-    if (found == -1) {
-        spin_unlock_irqrestore(&dev->dsp->irq_event_lock, flags);
-        pr_err("%d: %s: No free buffer available\n", num, __func__);
-        return -ENOMEM;
+    ret = dxrt_dram_alloc(&dev->mem, ctx, dsp_buf_meta.alloc_size, (uint32_t)msg->sub_cmd, &dsp_buf_meta);
+    if (ret) {
+        pr_err("%d: %s: failed to allocate 0x%x bytes (%d)\n", num, __func__, dsp_buf_meta.alloc_size, ret);
+        return ret;
     }
 
-    // Allocate the buffer
-    g_dsp_memory_manager.buffers[found].dsp_buf_offset = found * DSP_BUFFER_UNIT_SIZE;
-    g_dsp_memory_manager.buffers[found].alloc_size = DSP_BUFFER_UNIT_SIZE;
-
-    // Prepare buffer info to return to user
-    dsp_buf_meta.dsp_buf_offset = g_dsp_memory_manager.buffers[found].dsp_buf_offset;
-    dsp_buf_meta.alloc_size = g_dsp_memory_manager.buffers[found].alloc_size;
-
-    spin_unlock_irqrestore(&dev->dsp->irq_event_lock, flags);
-
     // Copy the allocated buffer metadata back to user space
     if (copy_to_user((void __user*)msg->data, &dsp_buf_meta, sizeof(dsp_buf_meta))) {
         pr_err("%d: %s: copy_to_user failed.\n", num, __func__);
         // Rollback the allocation
-        spin_lock_irqsave(&dev->dsp->irq_event_lock, flags);
-        g_dsp_memory_manager.buffers[found].alloc_size = 0;
-        spin_unlock_irqrestore(&dev->dsp->irq_event_lock, flags);
+        dxrt_dram_free(&dev->mem, ctx, dsp_buf_meta.dsp_buf_offset);
         return -EFAULT;
     }
 
-    pr_debug("%d: %s: Allocated buffer %d at offset 0x%x, size 0x%x\n", 
-             num, __func__, found, dsp_buf_meta.dsp_buf_offset, dsp_buf_meta.alloc_size);
+    pr_debug("%d: %s: Allocated buffer at offset 0x%x, size 0x%x\n", 
+             num, __func__, dsp_buf_meta.dsp_buf_offset, dsp_buf_meta.alloc_size);
 
     return 0;
 }
 
-static int dxrt_free_buf(struct dxdev* dev, dxrt_message_t* msg)
+static int dxrt_free_buf(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
 {
     int num = dev->id;
     dxrt_dsp_buffer_metadata_t dsp_buf_meta;
-    unsigned long flags;
-    int i;
-    int found = -1;
 
     pr_debug("%d: %s\n", num, __func__);
     
@@ -638,39 +762,229 @@ static int dxrt_free_buf(struct dxdev* dev, dxrt_message_t* msg)
         return -EFAULT;
     }
 
-    // Lock the memory manager for thread-safe access
-    spin_lock_irqsave(&dev->dsp->irq_event_lock, flags);
-
-    // Find the buffer with matching offset
-    for (i = 0; i < DSP_BUFFER_MAX_NUM; i++) {
-        if ((g_dsp_memory_manager.buffers[i].alloc_size != 0) &
-            (g_dsp_memory_manager.buffers[i].dsp_buf_offset == dsp_buf_meta.dsp_buf_offset)) {
-            found = i;
-            break;
-        }
+    if (dxrt_dram_free(&dev->mem, ctx, dsp_buf_meta.dsp_buf_offset)) {
+        pr_err("%d: %s: Buffer with offset 0x%x not found, not owned or already freed\n", 
+               num, __func__, dsp_buf_meta.dsp_buf_offset);               
+        return -EINVAL;
     }
 
-    if (found == -1) {
-        spin_unlock_irqrestore(&dev->dsp->irq_event_lock, flags);
-        pr_err("%d: %s: Buffer with offset 0x%x not found or already freed\n", 
-               num, __func__, dsp_buf_meta.dsp_buf_offset);               
+    pr_debug("%d: %s: Freed buffer at offset 0x%x\n", 
+             num, __func__, dsp_buf_meta.dsp_buf_offset);
+
+    return 0;
+}
+
+/**
+ * dxrt_poll_mode - Select how this file waits for completions
+ * @dev: The deepx device on kernel structure
+ * @msg: sub_cmd DX_POLL_IRQ or DX_POLL_HYBRID
+ * @ctx: The file context
+ *
+ * Return: 0 on success,
+ *        -EINVAL   if the sub-command is not supported
+ *        -EOPNOTSUPP if the device cannot be polled
+ */
+static int dxrt_poll_mode(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
+{
+    pr_debug("%d: %s: %d\n", dev->id, __func__, msg->sub_cmd);
+    switch (msg->sub_cmd) {
+    case DX_POLL_IRQ:
+        break;
+    case DX_POLL_HYBRID:
+        if (!dev->dsp->poll || !dev->dsp->poll_delay)
+            return -EOPNOTSUPP;
+        break;
+    default:
         return -EINVAL;
     }
+    WRITE_ONCE(ctx->poll_mode, msg->sub_cmd);
+    return 0;
+}
 
-    // Free the buffer by setting alloc_size to 0
-    g_dsp_memory_manager.buffers[found].alloc_size = 0;
+/**
+ * dxrt_dmabuf - Share DSP DRAM buffers with other devices through dma-buf
+ * @dev: The deepx device on kernel structure
+ * @msg: data = dxrt_dmabuf_t, sub_cmd = dxrt_dmabuf_sub_cmd_t
+ * @ctx: The file context
+ *
+ * DX_DMABUF_EXPORT : exports the buffer at dsp_buf_offset (DXRT_CMD_ALLOC_DSP_BUF on this
+ * file) as a dma-buf fd. The buffer stays allocated until it is freed and the dma-buf released.
+ * DX_DMABUF_IMPORT : maps the dma-buf fd (ISP, V4L2, NPU...) for the DSP and returns
+ * a handle with the device address to be used in the requests.
+ * DX_DMABUF_RELEASE : unmaps an imported handle, done on close() for the remaining ones.
+ *
+ * Return: 0 on success,
+ *        -EFAULT   if an error occurs during the copy(user <-> kernel)
+ *        -EINVAL   if no buffer of this file starts at dsp_buf_offset, the imported buffer is not
+ *                  contiguous for the DSP, handle is unknown or sub-command is not supported
+ *        -EBADF    if fd is not an open file
+ *        -ENOMEM   if an error occurs as memory allocation fail
+ */
+static int dxrt_dmabuf(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
+{
+    int ret, num = dev->id;
+    dxrt_dmabuf_t arg;
 
-    spin_unlock_irqrestore(&dev->dsp->irq_event_lock, flags);
+    pr_debug("%d: %s: %d\n", num, __func__, msg->sub_cmd);
+    if (msg->data == NULL)
+        return -EINVAL;
+    if (copy_from_user(&arg, (void __user*)msg->data, sizeof(arg)))
+        return -EFAULT;
+    switch (msg->sub_cmd) {
+    case DX_DMABUF_EXPORT:
+        ret = dxrt_dmabuf_export(dev, ctx, &arg);
+        break;
+    case DX_DMABUF_IMPORT:
+        ret = dxrt_dmabuf_import(dev, ctx, &arg);
+        break;
+    case DX_DMABUF_RELEASE:
+        return dxrt_handle_release(dev, ctx, arg.handle);
+    default:
+        return -EINVAL;
+    }
+    if (ret)
+        return ret;
+    if (copy_to_user((void __user*)msg->data, &arg, sizeof(arg))) {
+        pr_err("%d: %s: copy_to_user failed.\n", num, __func__);
+        return -EFAULT;
+    }
+    return 0;
+}
 
-    pr_debug("%d: %s: Freed buffer %d at offset 0x%x\n", 
-             num, __func__, found, dsp_buf_meta.dsp_buf_offset);
+/**
+ * dxrt_userptr - Let the DSP access user buffers directly
+ * @dev: The deepx device on kernel structure
+ * @msg: data = dxrt_userptr_t, sub_cmd = dxrt_userptr_sub_cmd_t
+ * @ctx: The file context
+ *
+ * DX_USERPTR_REGISTER pins and maps a user buffer once, the returned handle is
+ * reused across requests instead of copying through DXRT_CMD_WRITE_MEM / READ_MEM.
+ * Registered buffers are unpinned by DX_USERPTR_UNREGISTER or on close().
+ *
+ * Return: 0 on success,
+ *        -EFAULT   if an error occurs during the copy(user <-> kernel)
+ *                  if the user range is not mapped
+ *        -EINVAL   if the range or the handle is invalid or sub-command is not supported
+ *        -ENOMEM   if an error occurs as memory allocation fail
+ *                  if RLIMIT_MEMLOCK would be exceeded
+ *        -EOPNOTSUPP if the kernel is older than 5.8
+ */
+static int dxrt_userptr(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
+{
+#ifdef DXRT_HAS_USERPTR
+    int ret, num = dev->id;
+    dxrt_userptr_t arg;
 
+    pr_debug("%d: %s: %d\n", num, __func__, msg->sub_cmd);
+    if (msg->data == NULL)
+        return -EINVAL;
+    if (copy_from_user(&arg, (void __user*)msg->data, sizeof(arg)))
+        return -EFAULT;
+    switch (msg->sub_cmd) {
+    case DX_USERPTR_REGISTER:
+        ret = dxrt_userptr_register(dev, ctx, &arg);
+        break;
+    case DX_USERPTR_UNREGISTER:
+        return dxrt_handle_release(dev, ctx, arg.handle);
+    case DX_USERPTR_GET_SG:
+        ret = dxrt_userptr_get_sg(dev, ctx, &arg);
+        break;
+    case DX_USERPTR_SYNC:
+        return dxrt_userptr_sync(dev, ctx, &arg);
+    default:
+        return -EINVAL;
+    }
+    if (ret)
+        return ret;
+    if (copy_to_user((void __user*)msg->data, &arg, sizeof(arg))) {
+        pr_err("%d: %s: copy_to_user failed.\n", num, __func__);
+        return -EFAULT;
+    }
     return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+/**
+ * dxrt_mmap_populate - Prefault a DRAM / SRAM mapping
+ * @dev: The deepx device on kernel structure
+ * @msg: data = dxrt_mmap_populate_t
+ * @ctx: The file context
+ *
+ * DRAM and SRAM mappings are filled on first touch, this maps [addr, addr + size) up front
+ * (2MB blocks where the alignment allows) for callers who do not want the faults later.
+ *
+ * Return: 0 on success,
+ *        -EFAULT   if an error occurs during the copy(user <-> kernel)
+ *                  if a DRAM page of the range is not in a buffer of this file
+ *        -EINVAL   if the range is not inside a DRAM / SRAM mapping of this file
+ */
+static int dxrt_mmap_populate(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
+{
+    dxrt_mmap_populate_t arg;
+
+    if (msg->data == NULL)
+        return -EINVAL;
+    if (copy_from_user(&arg, (void __user*)msg->data, sizeof(arg)))
+        return -EFAULT;
+    pr_debug("%d: %s: %llx + %llx\n", dev->id, __func__, arg.addr, arg.size);
+    return dxrt_dram_populate(ctx, arg.addr, arg.size);
+}
+
+/**
+ * dxrt_staging - Acquire / release a staging buffer of DXRT_CMD_WRITE_MEM / READ_MEM
+ * @dev: The deepx device on kernel structure
+ * @msg: data = dxrt_staging_t, sub_cmd = dxrt_staging_sub_cmd_t
+ * @ctx: The file context
+ *
+ * DX_STAGING_ACQUIRE gives this file a buffer of its own (ch, dev_addr, size), so that
+ * uploads are not serialized on the shared buffer. Buffers still owned are released on close().
+ * DX_STAGING_WRITE / DX_STAGING_READ copy like DXRT_CMD_WRITE_MEM / READ_MEM
+ * (data = dxrt_req_meminfo_t), to or from the owned buffer meminfo.ch.
+ *
+ * Return: 0 on success,
+ *        -EFAULT       if an error occurs during the copy(user <-> kernel)
+ *        -EINVAL       if sub_cmd is unknown, or ch is not owned by this file (release, write, read)
+ *        -EBUSY        if every buffer is owned and DX_STAGING_NONBLOCK is set
+ *        -EOPNOTSUPP   if the device has no other buffer than ch 0
+ *        -ERESTARTSYS  if interrupted while waiting for a buffer
+ */
+static int dxrt_staging(struct dxdev* dev, dxrt_message_t* msg, struct dxrt_file_ctx *ctx)
+{
+    dxrt_staging_t arg;
+    int ret;
+
+    if (msg->data == NULL)
+        return -EINVAL;
+    /* data = dxrt_req_meminfo_t, ch : an owned buffer */
+    if (msg->sub_cmd == DX_STAGING_WRITE)
+        return dxrt_write_mem_buf(dev, msg, ctx, true);
+    if (msg->sub_cmd == DX_STAGING_READ)
+        return dxrt_read_mem_buf(dev, msg, ctx, true);
+    if (copy_from_user(&arg, (void __user*)msg->data, sizeof(arg)))
+        return -EFAULT;
+    pr_debug("%d: %s: sub_cmd %d ch %u flags %x\n", dev->id, __func__, msg->sub_cmd, arg.ch, arg.flags);
+    switch (msg->sub_cmd) {
+    case DX_STAGING_ACQUIRE:
+        ret = dxrt_staging_acquire(dev, ctx, &arg);
+        break;
+    case DX_STAGING_RELEASE:
+        return dxrt_staging_release(dev, ctx, arg.ch);
+    default:
+        return -EINVAL;
+    }
+    if (ret == 0 && copy_to_user((void __user*)msg->data, &arg, sizeof(arg)))
+    {
+        dxrt_staging_release(dev, ctx, arg.ch);
+        return -EFAULT;
+    }
+    return ret;
 }
 
-int message_handler_general(struct dxdev *dx, dxrt_message_t *msg)
+int message_handler_general(struct dxdev *dx, dxrt_message_t *msg, struct dxrt_file_ctx *ctx)
 {
-    return message_handler[msg->cmd](dx, msg);
+    return message_handler[msg->cmd](dx, msg, ctx);
 }
 
 dxrt_message_handler message_handler[] = {
@@ -703,4 +1017,9 @@ dxrt_message_handler message_handler[] = {
     [DXRT_CMD_SET_DDR_FREQ]         = dxrt_msg_general,
     [DXRT_CMD_ALLOC_DSP_BUF]        = dxrt_alloc_buf,
     [DXRT_CMD_FREE_DSP_BUF]         = dxrt_free_buf,
+    [DXRT_CMD_POLL_MODE]            = dxrt_poll_mode,
+    [DXRT_CMD_DMABUF]               = dxrt_dmabuf,
+    [DXRT_CMD_USERPTR]              = dxrt_userptr,
+    [DXRT_CMD_MMAP_POPULATE]        = dxrt_mmap_populate,
+    [DXRT_CMD_STAGING]              = dxrt_staging,
 };
\ No newline at end of file
@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include "dxrt_drv.h"
+
+/*
+ * Bounded MPSC ring (sequence-per-slot).
+ *  - slot->seq == pos         : slot is free for the producer at 'pos'
+ *  - slot->seq == pos + 1     : slot is published, consumer may read it
+ *  - slot->seq == pos + depth : released by the consumer for the next lap
+ */
+int dxrt_request_ring_init(dxrt_request_ring_t *ring, uint32_t depth)
+{
+    uint32_t i;
+
+    depth = clamp_t(uint32_t, depth, 2, DXRT_REQUEST_RING_DEPTH_MAX);
+    depth = roundup_pow_of_two(depth);
+
+    ring->slots = kcalloc(depth, sizeof(dxrt_request_slot_t), GFP_KERNEL);
+    if (!ring->slots)
+    {
+        pr_err("%s: failed to allocate %u slots\n", __func__, depth);
+        return -ENOMEM;
+    }
+    for (i = 0; i < depth; i++)
+        atomic_set(&ring->slots[i].seq, i);
+
+    ring->depth = depth;
+    ring->mask = depth - 1;
+    ring->tail = 0;
+    atomic_set(&ring->head, 0);
+    pr_debug("%s: depth %u\n", __func__, depth);
+    return 0;
+}
+
+void dxrt_request_ring_deinit(dxrt_request_ring_t *ring)
+{
+    kfree(ring->slots);
+    ring->slots = NULL;
+}
+
+/*
+ * Reserve 'num' consecutive slots with a single cmpxchg, so a batch is never
+ * interleaved with other producers. Slots are released in order by the consumer,
+ * so the batch fits once its last slot is free.
+ * Once reserved, the jobs are stamped with consecutive numbers from @seq (if not NULL),
+ * so that the numbers follow the order of the reservations of a file across rings.
+ * Returns 0 on success, -ENOSPC if the ring has not enough room. Safe for many producers.
+ */
+int dxrt_request_ring_push_batch(dxrt_request_ring_t *ring, const dxrt_dsp_job_t *jobs, uint32_t num,
+    atomic_t *seq)
+{
+    dxrt_request_slot_t *slot;
+    int pos = atomic_read(&ring->head);
+    int diff;
+    uint32_t i, first = 0;
+
+    if (num == 0 || num > ring->depth)
+        return -EINVAL;
+    for (;;)
+    {
+        slot = &ring->slots[(pos + num - 1) & ring->mask];
+        diff = atomic_read_acquire(&slot->seq) - (int)(pos + num - 1);
+        if (diff == 0)
+        {
+            if (atomic_try_cmpxchg(&ring->head, &pos, pos + num))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return -ENOSPC;
+        }
+        else
+        {
+            pos = atomic_read(&ring->head);
+        }
+    }
+    if (seq)
+        first = (uint32_t)atomic_add_return(num, seq) - num;
+    for (i = 0; i < num; i++)
+    {
+        slot = &ring->slots[(pos + i) & ring->mask];
+        memcpy(&slot->job, &jobs[i], sizeof(dxrt_dsp_job_t));
+        slot->job.seq = first + i;
+        atomic_set_release(&slot->seq, pos + i + 1);
+    }
+    return 0;
+}
+
+/* Returns 0 on success, -ENOSPC if the ring is full. Safe for many producers. */
+int dxrt_request_ring_push(dxrt_request_ring_t *ring, const dxrt_dsp_job_t *job)
+{
+    return dxrt_request_ring_push_batch(ring, job, 1, NULL);
+}
+
+/* Consumer only. The returned job stays valid until dxrt_request_ring_pop() */
+dxrt_dsp_job_t *dxrt_request_ring_peek(dxrt_request_ring_t *ring)
+{
+    dxrt_request_slot_t *slot = &ring->slots[ring->tail & ring->mask];
+
+    if (atomic_read_acquire(&slot->seq) != (int)(ring->tail + 1))
+        return NULL;
+    return &slot->job;
+}
+
+void dxrt_request_ring_pop(dxrt_request_ring_t *ring)
+{
+    dxrt_request_slot_t *slot = &ring->slots[ring->tail & ring->mask];
+
+    atomic_set_release(&slot->seq, ring->tail + ring->depth);
+    WRITE_ONCE(ring->tail, ring->tail + 1);
+}
+
+int dxrt_request_ring_empty(dxrt_request_ring_t *ring)
+{
+    return dxrt_request_ring_peek(ring) == NULL;
+}
+
+/* Approximate number of queued requests (reserved slots included), any context */
+uint32_t dxrt_request_ring_count(dxrt_request_ring_t *ring)
+{
+    return (uint32_t)atomic_read(&ring->head) - READ_ONCE(ring->tail);
+}
+
+/*
+ * Per-CPU submission rings, as the software queues of blk-mq : a producer pushes
+ * to the ring of the CPU it runs on, without touching the cachelines of the others.
+ * Any ring can take any producer (the rings are MPSC), so preemption or migration
+ * between the reservation and the publication is harmless.
+ */
+int dxrt_submit_queue_init(dxrt_submit_queue_t *q, uint32_t depth)
+{
+    uint32_t i;
+    int ret;
+
+    q->nr = nr_cpu_ids;
+    q->rings = kcalloc(q->nr, sizeof(dxrt_request_ring_t), GFP_KERNEL);
+    if (!q->rings)
+        return -ENOMEM;
+    for (i = 0; i < q->nr; i++)
+    {
+        ret = dxrt_request_ring_init(&q->rings[i], depth);
+        if (ret < 0)
+        {
+            while (i-- > 0)
+                dxrt_request_ring_deinit(&q->rings[i]);
+            kfree(q->rings);
+            q->rings = NULL;
+            return ret;
+        }
+    }
+    q->depth = q->rings[0].depth;
+    q->next = 0;
+    atomic64_set(&q->full_count, 0);
+    pr_debug("%s: %u rings of %u\n", __func__, q->nr, q->depth);
+    return 0;
+}
+
+void dxrt_submit_queue_deinit(dxrt_submit_queue_t *q)
+{
+    uint32_t i;
+
+    if (!q->rings)
+        return;
+    for (i = 0; i < q->nr; i++)
+        dxrt_request_ring_deinit(&q->rings[i]);
+    kfree(q->rings);
+    q->rings = NULL;
+}
+
+/* Pushes to the ring of the current CPU. Returns 0 on success, -ENOSPC if it is full */
+int dxrt_submit_queue_push(dxrt_submit_queue_t *q, const dxrt_dsp_job_t *jobs, uint32_t num, atomic_t *seq)
+{
+    return dxrt_request_ring_push_batch(&q->rings[raw_smp_processor_id() % q->nr], jobs, num, seq);
+}
+
+int dxrt_submit_queue_empty(dxrt_submit_queue_t *q)
+{
+    uint32_t i;
+
+    for (i = 0; i < q->nr; i++)
+    {
+        if (!dxrt_request_ring_empty(&q->rings[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/* Approximate number of queued requests, any context */
+uint32_t dxrt_submit_queue_count(dxrt_submit_queue_t *q)
+{
+    uint32_t i, n = 0;
+
+    for (i = 0; i < q->nr; i++)
+        n += dxrt_request_ring_count(&q->rings[i]);
+    return n;
+}
+
+/*
+ * Completion ring, shared with user space through mmap.
+ * Producers (irq / request handler) are serialized by ring->lock.
+ * 'tail' can be advanced by user space at any time, so it is only trusted
+ * within [head - depth, head].
+ */
+int dxrt_completion_ring_init(dxrt_completion_ring_t *ring, uint32_t depth)
+{
+    depth = clamp_t(uint32_t, depth, 2, DXRT_COMPLETION_RING_DEPTH_MAX);
+    depth = roundup_pow_of_two(depth);
+
+    ring->size = PAGE_ALIGN(sizeof(dxrt_completion_ring_hdr_t) + depth * sizeof(dxrt_completion_t));
+    ring->hdr = vmalloc_user(ring->size);
+    if (!ring->hdr)
+    {
+        pr_err("%s: failed to allocate %zu bytes\n", __func__, ring->size);
+        return -ENOMEM;
+    }
+    ring->entries = (dxrt_completion_t *)(ring->hdr + 1);
+    ring->mask = depth - 1;
+    ring->hdr->depth = depth;
+    ring->hdr->entry_size = sizeof(dxrt_completion_t);
+    ring->hdr->entry_offset = sizeof(dxrt_completion_ring_hdr_t);
+    spin_lock_init(&ring->lock);
+    pr_debug("%s: depth %u, %zu bytes\n", __func__, depth, ring->size);
+    return 0;
+}
+
+void dxrt_completion_ring_deinit(dxrt_completion_ring_t *ring)
+{
+    vfree(ring->hdr);
+    ring->hdr = NULL;
+}
+
+/* Returns 0 on success, -ENOSPC if the consumer did not keep up (entry dropped) */
+int dxrt_completion_ring_push(dxrt_completion_ring_t *ring, const dxrt_completion_t *comp)
+{
+    dxrt_completion_ring_hdr_t *hdr = ring->hdr;
+    unsigned long flags;
+    uint32_t head;
+    int ret = 0;
+
+    spin_lock_irqsave(&ring->lock, flags);
+    head = hdr->head;
+    if (head - READ_ONCE(hdr->tail) > ring->mask)
+    {
+        hdr->overflow++;
+        ret = -ENOSPC;
+    }
+    else
+    {
+        memcpy(&ring->entries[head & ring->mask], comp, sizeof(dxrt_completion_t));
+        smp_store_release(&hdr->head, head + 1);
+    }
+    spin_unlock_irqrestore(&ring->lock, flags);
+    return ret;
+}
+
+/* Kernel side consumer (read output ioctl). Returns 0 on success, -ENODATA if empty */
+int dxrt_completion_ring_pop(dxrt_completion_ring_t *ring, dxrt_completion_t *comp)
+{
+    dxrt_completion_ring_hdr_t *hdr = ring->hdr;
+    unsigned long flags;
+    uint32_t head, tail;
+    int ret = -ENODATA;
+
+    spin_lock_irqsave(&ring->lock, flags);
+    head = hdr->head;
+    tail = READ_ONCE(hdr->tail);
+    if (head - tail > ring->mask + 1)
+        tail = head - (ring->mask + 1);
+    if (tail != head)
+    {
+        memcpy(comp, &ring->entries[tail & ring->mask], sizeof(dxrt_completion_t));
+        smp_store_release(&hdr->tail, tail + 1);
+        ret = 0;
+    }
+    spin_unlock_irqrestore(&ring->lock, flags);
+    return ret;
+}
+
+int dxrt_completion_ring_empty(dxrt_completion_ring_t *ring)
+{
+    return smp_load_acquire(&ring->hdr->head) == READ_ONCE(ring->hdr->tail);
+}
+
+void dxrt_completion_ring_reset(dxrt_completion_ring_t *ring)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&ring->lock, flags);
+    ring->hdr->tail = ring->hdr->head;
+    spin_unlock_irqrestore(&ring->lock, flags);
+}
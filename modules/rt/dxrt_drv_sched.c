@@ -0,0 +1,562 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/version.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/cgroup.h>
+#include <linux/sysfs.h>
+#include "dxrt_drv.h"
+
+#if defined(CONFIG_CGROUPS) && (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0))
+#define DXRT_HAS_CGROUP_ID
+#endif
+
+#define DXRT_SCHED_FETCH_BATCH  16
+
+static uint sched_aging_ms = 100;
+module_param(sched_aging_ms, uint, 0644);
+MODULE_PARM_DESC(sched_aging_ms, "Queued requests are raised one priority class per this many ms of waiting, up to high, 0 : never (default 100)");
+
+#define DXRT_SCHED_CGROUP_MAX   16
+
+struct dxrt_sched_cgroup {
+    u64 id;
+    u32 weight;
+};
+static struct dxrt_sched_cgroup sched_cgroups[DXRT_SCHED_CGROUP_MAX];
+static int sched_cgroup_num;
+static DEFINE_SPINLOCK(sched_cgroup_lock);
+
+/* "id:weight[,id:weight...]", replaces the whole table */
+static int dxrt_sched_cgroup_set(const char *val, const struct kernel_param *kp)
+{
+    struct dxrt_sched_cgroup table[DXRT_SCHED_CGROUP_MAX];
+    char *buf, *cur, *tok, *sep;
+    int num = 0, ret = 0;
+
+    buf = kstrdup(val, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    cur = buf;
+    while ((tok = strsep(&cur, ", \n")) != NULL)
+    {
+        if (*tok == '\0')
+            continue;
+        sep = strchr(tok, ':');
+        if (!sep || num == DXRT_SCHED_CGROUP_MAX)
+        {
+            ret = -EINVAL;
+            break;
+        }
+        *sep++ = '\0';
+        if (kstrtou64(tok, 0, &table[num].id) || kstrtou32(sep, 0, &table[num].weight) ||
+            table[num].weight == 0 || table[num].weight > DX_SCHED_WEIGHT_MAX)
+        {
+            ret = -EINVAL;
+            break;
+        }
+        num++;
+    }
+    kfree(buf);
+    if (ret)
+        return ret;
+    spin_lock(&sched_cgroup_lock);
+    memcpy(sched_cgroups, table, num * sizeof(table[0]));
+    sched_cgroup_num = num;
+    spin_unlock(&sched_cgroup_lock);
+    return 0;
+}
+
+static int dxrt_sched_cgroup_get(char *buf, const struct kernel_param *kp)
+{
+    int i, len = 0;
+
+    spin_lock(&sched_cgroup_lock);
+    for (i = 0; i < sched_cgroup_num; i++)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s%llu:%u", i ? "," : "",
+            sched_cgroups[i].id, sched_cgroups[i].weight);
+    spin_unlock(&sched_cgroup_lock);
+    len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    return len;
+}
+
+static const struct kernel_param_ops dxrt_sched_cgroup_ops = {
+    .set = dxrt_sched_cgroup_set,
+    .get = dxrt_sched_cgroup_get,
+};
+module_param_cb(sched_cgroup_weights, &dxrt_sched_cgroup_ops, NULL, 0644);
+MODULE_PARM_DESC(sched_cgroup_weights, "Weight of the files opened from a cgroup v2 or its descendants, id:weight,... (id : inode number of the cgroup directory), read at open");
+
+#ifdef DXRT_HAS_CGROUP_ID
+static uint64_t dxrt_sched_cgroup_id(void)
+{
+    struct cgroup *cgrp;
+    uint64_t id;
+
+    rcu_read_lock();
+    cgrp = task_dfl_cgroup(current);
+    id = cgrp ? cgroup_id(cgrp) : 0;
+    rcu_read_unlock();
+    return id;
+}
+
+/* Weight of the nearest ancestor of the cgroup of current found in the table, 0 if none */
+static uint32_t dxrt_sched_cgroup_weight(void)
+{
+    struct cgroup *cgrp;
+    uint32_t weight = 0;
+    int i;
+
+    rcu_read_lock();
+    spin_lock(&sched_cgroup_lock);
+    for (cgrp = task_dfl_cgroup(current); cgrp && !weight && sched_cgroup_num; cgrp = cgroup_parent(cgrp))
+    {
+        for (i = 0; i < sched_cgroup_num; i++)
+        {
+            if (sched_cgroups[i].id == cgroup_id(cgrp))
+            {
+                weight = sched_cgroups[i].weight;
+                break;
+            }
+        }
+    }
+    spin_unlock(&sched_cgroup_lock);
+    rcu_read_unlock();
+    return weight;
+}
+#else
+static uint64_t dxrt_sched_cgroup_id(void)
+{
+    return 0;
+}
+
+static uint32_t dxrt_sched_cgroup_weight(void)
+{
+    return 0;
+}
+#endif
+
+/* Scheduling defaults of a file being opened by current */
+void dxrt_sched_ctx_init(struct dxrt_file_ctx *ctx)
+{
+    uint32_t weight = dxrt_sched_cgroup_weight();
+
+    ctx->sched_prio = DX_SCHED_PRIO_NORMAL;
+    ctx->sched_deadline_us = 0;
+    ctx->sched_cgroup_weight = weight ? weight : DX_SCHED_WEIGHT_DEFAULT;
+    ctx->sched_weight = ctx->sched_cgroup_weight;
+    ctx->cgroup_id = dxrt_sched_cgroup_id();
+    ctx->sched_set = false;
+    atomic64_set(&ctx->sched_vruntime, 0);
+    atomic64_set(&ctx->dsp_ns, 0);
+    atomic_set(&ctx->sched_seq, 0);
+    ctx->sched_next = 0;
+}
+
+/* Accounts the DSP time of a completed request to its file, IRQ context */
+void dxrt_sched_charge(struct dxrt_file_ctx *ctx, uint64_t exec_ns)
+{
+    uint32_t weight = READ_ONCE(ctx->sched_weight);
+
+    atomic64_add(exec_ns, &ctx->dsp_ns);
+    atomic64_add(div_u64(exec_ns * DX_SCHED_WEIGHT_DEFAULT, weight), &ctx->sched_vruntime);
+}
+
+/*
+ * Dispatcher scheduling : the request handler moves the published requests of the
+ * submission ring to one queue per priority class, and dispatches the head of the
+ * first non-empty class. Queues are kept in deadline order (EDF), requests without
+ * a deadline (U64_MAX) stay in FIFO order behind the others.
+ * Aging raises a request one class per sched_aging_ms it has waited, so that a
+ * busy higher class cannot starve the lower ones, up to DX_SCHED_PRIO_HIGH only :
+ * DX_SCHED_PRIO_RT needs CAP_SYS_NICE and is never reached by waiting.
+ * Requests without deadline are served by weighted fair queueing : the file with the
+ * smallest vruntime (DSP time charged on completion, divided by the weight) goes first,
+ * in FIFO order within a file. A file which was idle restarts from the virtual time
+ * of the device, so it gets its share but no credit for the time it did not use.
+ */
+int dxrt_sched_init(dxrt_sched_queue_t *q, uint32_t num)
+{
+    uint32_t i;
+
+    q->entries = kcalloc(num, sizeof(dxrt_sched_entry_t), GFP_KERNEL);
+    if (!q->entries)
+    {
+        pr_err("%s: failed to allocate %u entries\n", __func__, num);
+        return -ENOMEM;
+    }
+    spin_lock_init(&q->lock);
+    INIT_LIST_HEAD(&q->free);
+    for (i = 0; i < DX_SCHED_PRIO_NUM; i++)
+    {
+        INIT_LIST_HEAD(&q->queue[i]);
+        q->queued[i] = 0;
+    }
+    for (i = 0; i < num; i++)
+        list_add_tail(&q->entries[i].list, &q->free);
+    q->vtime = 0;
+    q->aged_ns = 0;
+    q->promoted = 0;
+    q->late = 0;
+    return 0;
+}
+
+void dxrt_sched_deinit(dxrt_sched_queue_t *q)
+{
+    kfree(q->entries);
+    q->entries = NULL;
+}
+
+/* Caller holds q->lock. Behind the entries of the same or an earlier deadline */
+static void dxrt_sched_insert(dxrt_sched_queue_t *q, dxrt_sched_entry_t *e)
+{
+    struct list_head *head = &q->queue[e->prio];
+    dxrt_sched_entry_t *pos;
+
+    list_for_each_entry_reverse(pos, head, list)
+    {
+        if (pos->job.deadline_ns <= e->job.deadline_ns)
+        {
+            list_add(&e->list, &pos->list);
+            q->queued[e->prio]++;
+            return;
+        }
+    }
+    list_add(&e->list, head);
+    q->queued[e->prio]++;
+}
+
+/* Caller holds q->lock. Only runs while a higher class has requests, at most once per ms */
+static void dxrt_sched_age(dxrt_sched_queue_t *q, uint64_t now)
+{
+    uint64_t aging_ns = (uint64_t)READ_ONCE(sched_aging_ms) * NSEC_PER_MSEC;
+    dxrt_sched_entry_t *e, *tmp;
+    bool higher = q->queued[DX_SCHED_PRIO_RT] > 0;
+    int c;
+
+    if (aging_ns == 0 || now - q->aged_ns < NSEC_PER_MSEC)
+        return;
+    q->aged_ns = now;
+    for (c = DX_SCHED_PRIO_HIGH + 1; c < DX_SCHED_PRIO_NUM; c++)
+    {
+        higher |= q->queued[c - 1] > 0;
+        if (!higher)
+            continue;
+        list_for_each_entry_safe(e, tmp, &q->queue[c], list)
+        {
+            /* one more class for every aging period waited */
+            if (now - e->job.submit_ns < (uint64_t)(e->job.prio - c + 1) * aging_ns)
+                continue;
+            list_del(&e->list);
+            q->queued[c]--;
+            e->prio = c - 1;
+            dxrt_sched_insert(q, e);
+            q->promoted++;
+        }
+    }
+}
+
+/* Caller holds q->lock */
+static void dxrt_sched_add(dxrt_sched_queue_t *q, dxrt_dsp_job_t *job)
+{
+    dxrt_sched_entry_t *e = list_first_entry(&q->free, dxrt_sched_entry_t, list);
+    uint64_t vruntime;
+
+    list_del(&e->list);
+    memcpy(&e->job, job, sizeof(dxrt_dsp_job_t));
+    vruntime = atomic64_read(&e->job.ctx->sched_vruntime);
+    if (vruntime < q->vtime)
+        atomic64_cmpxchg(&e->job.ctx->sched_vruntime, vruntime, q->vtime);
+    e->prio = e->job.prio;
+    dxrt_sched_insert(q, e);
+}
+
+/*
+ * Moves the published requests of the per-CPU rings to the class queues. Dispatcher only.
+ * Up to DXRT_SCHED_FETCH_BATCH requests per ring and round, starting from a different
+ * ring each time, so that a CPU with a long backlog cannot hold the free entries.
+ */
+void dxrt_sched_fetch(struct dxdev *dx)
+{
+    dxrt_sched_queue_t *q = &dx->sched;
+    dxrt_submit_queue_t *sq = &dx->requests;
+    dxrt_request_ring_t *ring;
+    dxrt_dsp_job_t *job;
+    uint32_t i, n, fetched = 0;
+    bool more;
+
+    spin_lock(&q->lock);
+    do
+    {
+        more = false;
+        for (i = 0; i < sq->nr && !list_empty(&q->free); i++)
+        {
+            ring = &sq->rings[(sq->next + i) % sq->nr];
+            for (n = 0; n < DXRT_SCHED_FETCH_BATCH && !list_empty(&q->free) &&
+                (job = dxrt_request_ring_peek(ring)) != NULL; n++)
+            {
+                dxrt_sched_add(q, job);
+                dxrt_request_ring_pop(ring);
+            }
+            more |= n == DXRT_SCHED_FETCH_BATCH;
+            fetched += n;
+        }
+    } while (more && !list_empty(&q->free));
+    sq->next = (sq->next + 1) % sq->nr;
+    spin_unlock(&q->lock);
+    if (fetched && wq_has_sleeper(&dx->request_space_wq))
+        wake_up_interruptible(&dx->request_space_wq);
+}
+
+/*
+ * A file's requests are dispatched in submission order, even when its submitter moved
+ * between CPUs : a request waits until the previous one of its file has been picked.
+ * Files of the aggregate node spread their requests over the devices, they have no order.
+ */
+static bool dxrt_sched_in_order(dxrt_sched_entry_t *e)
+{
+    struct dxrt_file_ctx *ctx = e->job.ctx;
+
+    return ctx->agg || (int)(e->job.seq - ctx->sched_next) <= 0;
+}
+
+/* Caller holds q->lock. Earliest deadline first, then the smallest vruntime, NULL if none is in order */
+static dxrt_sched_entry_t *dxrt_sched_pick_class(dxrt_sched_queue_t *q, struct list_head *head)
+{
+    dxrt_sched_entry_t *e, *best = NULL;
+    uint64_t vruntime, best_vruntime = 0;
+
+    list_for_each_entry(e, head, list)
+    {
+        if (!dxrt_sched_in_order(e))
+            continue;
+        /* the queue is in deadline order, the requests without one come last */
+        if (e->job.deadline_ns != U64_MAX)
+            return e;
+        vruntime = atomic64_read(&e->job.ctx->sched_vruntime);
+        if (!best || vruntime < best_vruntime)
+        {
+            best = e;
+            best_vruntime = vruntime;
+        }
+    }
+    if (best)
+        q->vtime = max(q->vtime, best_vruntime);
+    return best;
+}
+
+/* Caller holds q->lock */
+static dxrt_sched_entry_t *dxrt_sched_first(dxrt_sched_queue_t *q)
+{
+    int c;
+
+    for (c = 0; c < DX_SCHED_PRIO_NUM; c++)
+    {
+        if (!list_empty(&q->queue[c]))
+            return list_first_entry(&q->queue[c], dxrt_sched_entry_t, list);
+    }
+    return NULL;
+}
+
+/* Next request to dispatch, NULL if none. Give it back with dxrt_sched_put() once run */
+dxrt_sched_entry_t *dxrt_sched_pick(struct dxdev *dx)
+{
+    dxrt_sched_queue_t *q = &dx->sched;
+    dxrt_sched_entry_t *e = NULL;
+    struct dxrt_file_ctx *ctx;
+    uint64_t now = ktime_get_ns();
+    int c;
+
+    spin_lock(&q->lock);
+    dxrt_sched_age(q, now);
+    for (c = 0; c < DX_SCHED_PRIO_NUM && !e; c++)
+    {
+        if (!list_empty(&q->queue[c]))
+            e = dxrt_sched_pick_class(q, &q->queue[c]);
+    }
+    /*
+     * Every entry waits for an earlier request which is still in a ring (its producer
+     * was preempted before publishing it) : dispatch out of order rather than stall.
+     */
+    if (!e && list_empty(&q->free))
+        e = dxrt_sched_first(q);
+    if (e)
+    {
+        ctx = e->job.ctx;
+        list_del(&e->list);
+        q->queued[e->prio]--;
+        if (e->job.deadline_ns < now)
+            q->late++;
+        if (!ctx->agg && (int)(e->job.seq - ctx->sched_next) >= 0)
+            ctx->sched_next = e->job.seq + 1;
+    }
+    spin_unlock(&q->lock);
+    return e;
+}
+
+/* Fails every request left in the rings and the queues, once the dispatcher stops */
+void dxrt_sched_cancel(struct dxdev *dx)
+{
+    dxrt_sched_queue_t *q = &dx->sched;
+    dxrt_sched_entry_t *e;
+
+    for (;;)
+    {
+        dxrt_sched_fetch(dx);
+        spin_lock(&q->lock);
+        e = dxrt_sched_first(q);
+        if (e)
+        {
+            list_del(&e->list);
+            q->queued[e->prio]--;
+        }
+        spin_unlock(&q->lock);
+        if (!e)
+            break;
+        dxrt_dsp_job_fail(&e->job, -ECANCELED);
+        dxrt_sched_put(q, e);
+    }
+}
+
+void dxrt_sched_put(dxrt_sched_queue_t *q, dxrt_sched_entry_t *e)
+{
+    spin_lock(&q->lock);
+    list_add(&e->list, &q->free);
+    spin_unlock(&q->lock);
+}
+
+/* Approximate number of queued requests, any context */
+uint32_t dxrt_sched_count(dxrt_sched_queue_t *q)
+{
+    uint32_t i, n = 0;
+
+    for (i = 0; i < DX_SCHED_PRIO_NUM; i++)
+        n += READ_ONCE(q->queued[i]);
+    return n;
+}
+
+ssize_t dxrt_sched_show(dxrt_sched_queue_t *q, char *buf)
+{
+    uint32_t queued[DX_SCHED_PRIO_NUM];
+    uint64_t promoted, late;
+
+    spin_lock(&q->lock);
+    memcpy(queued, q->queued, sizeof(queued));
+    promoted = q->promoted;
+    late = q->late;
+    spin_unlock(&q->lock);
+    return sysfs_emit(buf, "queued rt %u high %u normal %u low %u promoted %llu late %llu aging_ms %u\n",
+        queued[DX_SCHED_PRIO_RT], queued[DX_SCHED_PRIO_HIGH], queued[DX_SCHED_PRIO_NORMAL],
+        queued[DX_SCHED_PRIO_LOW], promoted, late, READ_ONCE(sched_aging_ms));
+}
+
+/* usage of one open file, aggregated per process then per cgroup by dxrt_sched_utilization_show() */
+struct dxrt_sched_util {
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+    uint64_t cgroup_id;
+    uint64_t ns;
+    uint32_t weight;
+};
+
+static int dxrt_sched_util_cmp_pid(const void *a, const void *b)
+{
+    const struct dxrt_sched_util *x = a, *y = b;
+
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+static int dxrt_sched_util_cmp_cgroup(const void *a, const void *b)
+{
+    const struct dxrt_sched_util *x = a, *y = b;
+
+    return (x->cgroup_id > y->cgroup_id) - (x->cgroup_id < y->cgroup_id);
+}
+
+/* One line per run of @u (sorted by pid, or by cgroup id), or a last "truncated" line near PAGE_SIZE */
+static int dxrt_sched_util_emit(struct dxrt_sched_util *u, uint32_t num, uint64_t total, bool by_cgroup,
+    char *buf, int len, bool *truncated)
+{
+    uint64_t ns, share;
+    uint32_t i, j, weight;
+
+    for (i = 0; i < num; i = j)
+    {
+        ns = 0;
+        weight = 0;
+        for (j = i; j < num && (by_cgroup ? u[j].cgroup_id == u[i].cgroup_id : u[j].pid == u[i].pid); j++)
+        {
+            ns += u[j].ns;
+            weight += u[j].weight;
+        }
+        if (len > PAGE_SIZE - DXRT_SYSFS_LINE_MAX)
+        {
+            *truncated = true;
+            return len + sysfs_emit_at(buf, len, "truncated\n");
+        }
+        share = total ? div64_u64(ns * 1000, total) : 0;
+        if (by_cgroup)
+            len += sysfs_emit_at(buf, len, "cgroup %llu %u %llu %llu.%llu\n", u[i].cgroup_id, weight,
+                div_u64(ns, NSEC_PER_USEC), share / 10, share % 10);
+        else
+            len += sysfs_emit_at(buf, len, "%d %s %u %llu %llu.%llu\n", u[i].pid, u[i].comm, weight,
+                div_u64(ns, NSEC_PER_USEC), share / 10, share % 10);
+    }
+    return len;
+}
+
+/*
+ * One line per process : pid comm weight dsp_us share(%) of the DSP time used by all open files,
+ * then one line per cgroup of the openers : "cgroup" id weight dsp_us share(%) (id 0 : unknown).
+ * The files are copied in one pass under files_lock, then sorted to be aggregated.
+ */
+ssize_t dxrt_sched_utilization_show(struct dxdev *dx, char *buf)
+{
+    struct dxrt_file_ctx *ctx;
+    struct dxrt_sched_util *u;
+    uint32_t num = 0, i = 0;
+    uint64_t total = 0;
+    bool truncated = false;
+    int len;
+
+    mutex_lock(&dx->files_lock);
+    list_for_each_entry(ctx, &dx->files, list)
+        num++;
+    u = kvmalloc_array(max_t(uint32_t, num, 1), sizeof(*u), GFP_KERNEL);
+    if (!u)
+    {
+        mutex_unlock(&dx->files_lock);
+        return -ENOMEM;
+    }
+    list_for_each_entry(ctx, &dx->files, list)
+    {
+        u[i].pid = ctx->pid;
+        memcpy(u[i].comm, ctx->comm, sizeof(u[i].comm));
+        u[i].cgroup_id = ctx->cgroup_id;
+        u[i].ns = atomic64_read(&ctx->dsp_ns);
+        u[i].weight = READ_ONCE(ctx->sched_weight);
+        total += u[i].ns;
+        i++;
+    }
+    mutex_unlock(&dx->files_lock);
+
+    sort(u, num, sizeof(*u), dxrt_sched_util_cmp_pid, NULL);
+    len = dxrt_sched_util_emit(u, num, total, false, buf, 0, &truncated);
+    if (!truncated)
+    {
+        sort(u, num, sizeof(*u), dxrt_sched_util_cmp_cgroup, NULL);
+        len = dxrt_sched_util_emit(u, num, total, true, buf, len, &truncated);
+    }
+    kvfree(u);
+    return len;
+}
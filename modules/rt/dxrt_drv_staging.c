@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/moduleparam.h>
+#include <linux/dma-mapping.h>
+#include <linux/wait.h>
+#include "dxrt_drv.h"
+
+static uint staging_num = 4;
+module_param(staging_num, uint, 0444);
+MODULE_PARM_DESC(staging_num, "Staging buffers per device for DXRT_CMD_WRITE_MEM / READ_MEM, including the shared one (default 4, max 16)");
+
+static uint staging_size;
+module_param(staging_size, uint, 0444);
+MODULE_PARM_DESC(staging_size, "Bytes per owned staging buffer (default 0 : dma-buf-size of the device tree)");
+
+/*
+ * Staging buffers : ch 0 is the legacy dsp->dma_buf, shared by every file.
+ * ch 1.. are coherent buffers owned by one file at a time (DXRT_CMD_STAGING),
+ * so that the upload of a request can overlap the execution of the previous one.
+ */
+int dxrt_staging_init(struct dxdev *dx)
+{
+    dxrt_staging_pool_t *pool = &dx->staging;
+    struct dxdsp *dsp = dx->dsp;
+    size_t size = staging_size ? PAGE_ALIGN(staging_size) : dsp->dma_buf_size;
+    uint32_t i, num = clamp_t(uint32_t, staging_num, 1, DXRT_STAGING_MAX);
+
+    spin_lock_init(&pool->lock);
+    init_waitqueue_head(&pool->wq);
+    pool->buf[0] = dsp->dma_buf;
+    pool->addr[0] = dsp->dma_buf_addr;
+    pool->size[0] = dsp->dma_buf_size;
+    pool->owner[0] = NULL;
+    for (i = 1; i < num; i++)
+    {
+        pool->buf[i] = dma_alloc_coherent(dsp->dev, size, &pool->addr[i], GFP_KERNEL);
+        if (!pool->buf[i])
+        {
+            pr_warn("%d: %s: %u staging buffers of 0x%zx bytes\n", dx->id, __func__, i, size);
+            break;
+        }
+        pool->size[i] = size;
+        pool->owner[i] = NULL;
+    }
+    pool->num = i;
+    pr_debug("%d: %s: %u x 0x%zx\n", dx->id, __func__, pool->num, size);
+    return 0;
+}
+
+void dxrt_staging_deinit(struct dxdev *dx)
+{
+    dxrt_staging_pool_t *pool = &dx->staging;
+    uint32_t i;
+
+    for (i = 1; i < pool->num; i++)
+        dma_free_coherent(dx->dsp->dev, pool->size[i], pool->buf[i], pool->addr[i]);
+    pool->num = 0;
+}
+
+static int dxrt_staging_try(dxrt_staging_pool_t *pool, struct dxrt_file_ctx *ctx)
+{
+    int i, ch = -1;
+
+    spin_lock(&pool->lock);
+    for (i = 1; i < pool->num; i++)
+    {
+        if (!pool->owner[i])
+        {
+            pool->owner[i] = ctx;
+            ch = i;
+            break;
+        }
+    }
+    spin_unlock(&pool->lock);
+    return ch;
+}
+
+/* DX_STAGING_ACQUIRE : waits for a free buffer unless DX_STAGING_NONBLOCK */
+int dxrt_staging_acquire(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_staging_t *arg)
+{
+    dxrt_staging_pool_t *pool = &dx->staging;
+    int ch = -1;
+
+    if (pool->num <= 1)
+        return -EOPNOTSUPP;
+    if (arg->flags & DX_STAGING_NONBLOCK)
+        ch = dxrt_staging_try(pool, ctx);
+    else if (wait_event_interruptible(pool->wq,
+            (ch = dxrt_staging_try(pool, ctx)) >= 0 || READ_ONCE(dx->dead)))
+        return -ERESTARTSYS;
+    if (ch < 0)
+        return READ_ONCE(dx->dead) ? -ENODEV : -EBUSY;
+    arg->ch = ch;
+    arg->dev_addr = pool->addr[ch];
+    arg->size = pool->size[ch];
+    return 0;
+}
+
+/* DX_STAGING_RELEASE : returns -EINVAL if @ch is not owned by @ctx */
+int dxrt_staging_release(struct dxdev *dx, struct dxrt_file_ctx *ctx, uint32_t ch)
+{
+    dxrt_staging_pool_t *pool = &dx->staging;
+    int ret = -EINVAL;
+
+    spin_lock(&pool->lock);
+    if (ch > 0 && ch < pool->num && pool->owner[ch] == ctx)
+    {
+        pool->owner[ch] = NULL;
+        ret = 0;
+    }
+    spin_unlock(&pool->lock);
+    if (ret == 0)
+        wake_up(&pool->wq);
+    return ret;
+}
+
+/* Releases every buffer still owned by a closing file */
+void dxrt_staging_release_ctx(struct dxdev *dx, struct dxrt_file_ctx *ctx)
+{
+    dxrt_staging_pool_t *pool = &dx->staging;
+    bool wake = false;
+    uint32_t i;
+
+    spin_lock(&pool->lock);
+    for (i = 1; i < pool->num; i++)
+    {
+        if (pool->owner[i] == ctx)
+        {
+            pool->owner[i] = NULL;
+            wake = true;
+        }
+    }
+    spin_unlock(&pool->lock);
+    if (wake)
+        wake_up(&pool->wq);
+}
+
+/* Kernel address of [offset, offset + size) in buffer @ch, NULL if out of bounds or not owned */
+void *dxrt_staging_buf(struct dxdev *dx, struct dxrt_file_ctx *ctx, uint32_t ch, uint64_t offset, uint64_t size)
+{
+    dxrt_staging_pool_t *pool = &dx->staging;
+    void *buf = NULL;
+
+    spin_lock(&pool->lock);
+    if (ch < pool->num && (ch == 0 || pool->owner[ch] == ctx) &&
+        offset <= pool->size[ch] && size <= pool->size[ch] - offset)
+        buf = pool->buf[ch] + offset;
+    spin_unlock(&pool->lock);
+    return buf;
+}
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/math64.h>
+#include <linux/cpumask.h>
+#include "dxrt_drv.h"
+
+/*
+ * Device attributes : /sys/class/dxrt_dsp/dxrt_dspN/
+ */
+static ssize_t ring_depth_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%u\n", dx->requests.depth);
+}
+static DEVICE_ATTR_RO(ring_depth);
+
+static ssize_t ring_full_count_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&dx->requests.full_count));
+}
+static DEVICE_ATTR_RO(ring_full_count);
+
+static ssize_t completion_overflow_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&dx->completion_overflow));
+}
+static DEVICE_ATTR_RO(completion_overflow);
+
+static ssize_t pipeline_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    struct dxdsp *dsp = dx->dsp;
+    return sysfs_emit(buf, "depth %u inflight %u credits %u\n",
+        dsp->pipeline_depth, READ_ONCE(dsp->inflight_num), READ_ONCE(dsp->credits));
+}
+static DEVICE_ATTR_RO(pipeline);
+
+/*
+ * Lifetime cpu time of the request handler : sum_exec_runtime of a running task lags by
+ * at most its current slice, which does not matter over many requests, whereas deltas
+ * around one request would mostly read the same stale value.
+ */
+static ssize_t dispatch_cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    uint64_t count = READ_ONCE(dx->dispatch_count);
+    uint64_t cpu_ns;
+
+    mutex_lock(&dx->tune_lock);
+    cpu_ns = READ_ONCE(dx->dispatch_cpu_ns);
+    if (dx->request_handler)
+        cpu_ns += READ_ONCE(dx->request_handler->se.sum_exec_runtime);
+    mutex_unlock(&dx->tune_lock);
+    return sysfs_emit(buf, "requests %llu cpu_ns %llu avg_ns %llu direct %llu\n",
+        count, cpu_ns, count ? div64_u64(cpu_ns, count) : 0, READ_ONCE(dx->direct_count));
+}
+static DEVICE_ATTR_RO(dispatch_cpu);
+
+/* SCHED_FIFO priority of the request handler, 0 : SCHED_NORMAL */
+static ssize_t dispatch_prio_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dx->dispatch_prio));
+}
+static ssize_t dispatch_prio_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t count)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    uint32_t prio;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &prio);
+    if (ret == 0)
+        ret = dxrt_dispatch_set_prio(dx, prio);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(dispatch_prio);
+
+/* cpu list, e.g. "2-3" : the empty list resets the cpus (dispatch_cpus) or drops the hint (irq_cpus) */
+static ssize_t dxrt_cpus_show(struct dxdev *dx, const struct cpumask *mask, char *buf)
+{
+    ssize_t len;
+
+    mutex_lock(&dx->tune_lock);
+    len = sysfs_emit(buf, "%*pbl\n", cpumask_pr_args(mask));
+    mutex_unlock(&dx->tune_lock);
+    return len;
+}
+static ssize_t dxrt_cpus_store(struct dxdev *dx, int (*set)(struct dxdev *, const struct cpumask *),
+    const char *buf, size_t count)
+{
+    cpumask_var_t mask;
+    int ret;
+
+    if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+        return -ENOMEM;
+    ret = cpulist_parse(buf, mask);
+    if (ret == 0)
+        ret = set(dx, mask);
+    free_cpumask_var(mask);
+    return ret ? ret : count;
+}
+
+static ssize_t dispatch_cpus_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return dxrt_cpus_show(dx, &dx->dispatch_cpus, buf);
+}
+static ssize_t dispatch_cpus_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t count)
+{
+    return dxrt_cpus_store(dev_get_drvdata(dev), dxrt_dispatch_set_cpus, buf, count);
+}
+static DEVICE_ATTR_RW(dispatch_cpus);
+
+static ssize_t irq_cpus_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return dxrt_cpus_show(dx, &dx->irq_cpus, buf);
+}
+static ssize_t irq_cpus_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t count)
+{
+    return dxrt_cpus_store(dev_get_drvdata(dev), dxrt_dispatch_set_irq_cpus, buf, count);
+}
+static DEVICE_ATTR_RW(irq_cpus);
+
+/* one line per open file : pid comm submitted completed */
+static ssize_t clients_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    struct dxrt_file_ctx *ctx;
+    int len = 0;
+
+    mutex_lock(&dx->files_lock);
+    list_for_each_entry(ctx, &dx->files, list)
+    {
+        if (len > PAGE_SIZE - DXRT_SYSFS_LINE_MAX)
+        {
+            len += sysfs_emit_at(buf, len, "truncated\n");
+            break;
+        }
+        len += sysfs_emit_at(buf, len, "%d %s %lld %lld\n", ctx->pid, ctx->comm,
+            atomic64_read(&ctx->submitted), atomic64_read(&ctx->completed));
+    }
+    mutex_unlock(&dx->files_lock);
+    return len;
+}
+static DEVICE_ATTR_RO(clients);
+
+/* hybrid poll hits/misses, then the execution time estimate of each func_id bucket */
+static ssize_t hybrid_poll_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    struct dxdsp *dsp = dx->dsp;
+    int i, len;
+
+    len = sysfs_emit(buf, "hit %lld miss %lld\n",
+        atomic64_read(&dx->poll_hit), atomic64_read(&dx->poll_miss));
+    for (i = 0; i < DSP_EXEC_EST_NUM; i++)
+    {
+        uint64_t est = READ_ONCE(dsp->exec_est_ns[i]);
+        if (est)
+            len += sysfs_emit_at(buf, len, "func %d est_ns %llu\n", i, est);
+    }
+    return len;
+}
+static DEVICE_ATTR_RO(hybrid_poll);
+
+/* requests waiting in each priority class of the dispatcher */
+static ssize_t sched_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return dxrt_sched_show(&dx->sched, buf);
+}
+static DEVICE_ATTR_RO(sched);
+
+static ssize_t utilization_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return dxrt_sched_utilization_show(dx, buf);
+}
+static DEVICE_ATTR_RO(utilization);
+
+static ssize_t dram_pool_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return dxrt_dram_pool_show(&dx->mem, buf);
+}
+static DEVICE_ATTR_RO(dram_pool);
+
+/* runs on each read (takes a few hundred ms), root only */
+static ssize_t upload_bench_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct dxdev *dx = dev_get_drvdata(dev);
+    return dxrt_dram_upload_bench(&dx->mem, buf);
+}
+static DEVICE_ATTR(upload_bench, 0400, upload_bench_show, NULL);
+
+static struct attribute *dxrt_dev_attrs[] = {
+    &dev_attr_ring_depth.attr,
+    &dev_attr_ring_full_count.attr,
+    &dev_attr_completion_overflow.attr,
+    &dev_attr_pipeline.attr,
+    &dev_attr_dispatch_cpu.attr,
+    &dev_attr_dispatch_prio.attr,
+    &dev_attr_dispatch_cpus.attr,
+    &dev_attr_irq_cpus.attr,
+    &dev_attr_clients.attr,
+    &dev_attr_hybrid_poll.attr,
+    &dev_attr_sched.attr,
+    &dev_attr_utilization.attr,
+    &dev_attr_dram_pool.attr,
+    &dev_attr_upload_bench.attr,
+    NULL,
+};
+
+static const struct attribute_group dxrt_dev_group = {
+    .attrs = dxrt_dev_attrs,
+};
+
+const struct attribute_group *dxrt_dev_groups[] = {
+    &dxrt_dev_group,
+    NULL,
+};
@@ -5,17 +5,89 @@
  * Copyright (C) 2023 Deepx, Inc.
  *
  */
+#include <linux/version.h>
 #include <linux/io.h>
 #include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/sched/prio.h>
+#include <linux/cpumask.h>
+#include <linux/interrupt.h>
+#include <uapi/linux/sched/types.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
 #include "dxrt_drv.h"
 
-int dxrt_is_request_list_empty(dxrt_request_list_t *requests, spinlock_t *lock)
+static bool direct_dispatch = true;
+module_param(direct_dispatch, bool, 0644);
+MODULE_PARM_DESC(direct_dispatch, "Submitters write the request to an idle DSP themselves instead of waking the request handler (default true)");
+
+static uint dispatch_prio;
+module_param(dispatch_prio, uint, 0444);
+MODULE_PARM_DESC(dispatch_prio, "SCHED_FIFO priority of the request handlers at load, 1..99, 0 : SCHED_NORMAL (default 0, per device in sysfs dispatch_prio)");
+
+/* Complete a job which never reached the DSP, the error is returned in response.status */
+void dxrt_dsp_job_fail(dxrt_dsp_job_t *job, int err)
+{
+    dxrt_completion_t comp;
+
+    memset(&comp, 0, sizeof(comp));
+    comp.response.req_id = job->request.req_id;
+    comp.response.status = err;
+    comp.submit_ns = job->submit_ns;
+    comp.irq_ns = ktime_get_ns();
+    dxrt_job_complete(job->ctx, job->ucmd, &comp);
+}
+
+/*
+ * Fast path of an idle device : the submitter writes the request to the DSP itself
+ * and saves the wakeup of the request handler. Only taken when nothing is queued,
+ * so that no request is overtaken, and when a message slot is free without waiting.
+ * A request of the same file can have its seq but not be visible in its ring yet :
+ * the seq is reserved only if every earlier one was dispatched (sched_seq == sched_next).
+ * Returns true if the job was dispatched (or completed with an error), false to queue it.
+ */
+bool dxrt_dispatch_direct(struct dxdev *dx, dxrt_dsp_job_t *job)
 {
-    int empty;
-    spin_lock(lock);
-    empty = list_empty(&requests->list);
-    spin_unlock(lock);
-    return empty;
+    struct dxrt_file_ctx *ctx = job->ctx;
+    dxdsp_t *dsp = dx->dsp;
+    uint32_t seq;
+    int ret;
+
+    if (!READ_ONCE(direct_dispatch) || !dsp->try_run || ctx->agg)
+        return false;
+    /* the rings first : the request handler adds to the queues before it pops the ring */
+    if (!dxrt_submit_queue_empty(&dx->requests) || dxrt_sched_count(&dx->sched))
+        return false;
+    if (!mutex_trylock(&dx->dispatch_lock))
+        return false;
+    if (!dxrt_submit_queue_empty(&dx->requests) || dxrt_sched_count(&dx->sched))
+    {
+        mutex_unlock(&dx->dispatch_lock);
+        return false;
+    }
+    seq = ctx->sched_next;
+    if (atomic_cmpxchg(&ctx->sched_seq, seq, seq + 1) != (int)seq)
+    {
+        mutex_unlock(&dx->dispatch_lock);
+        return false;
+    }
+    job->seq = seq;
+    /* the seq is used up whatever happens : a queued job takes a new one, after the reserved ones */
+    ctx->sched_next = seq + 1;
+    ret = dsp->try_run(dsp, job);
+    if (ret == -EBUSY)
+    {
+        mutex_unlock(&dx->dispatch_lock);
+        return false;
+    }
+    if (ret < 0)
+    {
+        pr_debug( MODULE_NAME "%d: %s req %d failed (%d)\n", dx->id, __func__, job->request.req_id, ret);
+        dxrt_dsp_job_fail(job, ret);
+    }
+    WRITE_ONCE(dx->direct_count, dx->direct_count + 1);
+    mutex_unlock(&dx->dispatch_lock);
+    return true;
 }
 
 int dxrt_request_handler(void *data)
@@ -23,30 +95,185 @@ int dxrt_request_handler(void *data)
 	struct dxdev *dx = (struct dxdev*)data;
 	struct dxdsp *dsp = dx->dsp;
     int num = dx->id;
-    dxrt_request_list_t *entry;
-    // dxrt_dsp_request_t *req;
+    dxrt_sched_entry_t *e;
     pr_debug( MODULE_NAME "%d: %s start.\n", num, __func__);
     while(!kthread_should_stop())
     {
         wait_event_interruptible(
             dx->request_wq,
-            !dxrt_is_request_list_empty(&dx->requests, &dx->requests_lock) || kthread_should_stop()            
+            !dxrt_submit_queue_empty(&dx->requests) || kthread_should_stop()
         );
         if(kthread_should_stop()) break;
-        pr_debug( MODULE_NAME "%d: %s wake up.\n", num, __func__);        
-        spin_lock(&dx->requests_lock);
-        entry = list_first_entry(&dx->requests.list, dxrt_request_list_t, list);            
-            // req = &entry->request;
-            // pr_debug( MODULE_NAME "%d: %s: req %d\n", 
-            //     num, __func__, req->req_id
-            // );
-        spin_unlock(&dx->requests_lock);
-        dsp->run(dsp, &entry->request);
-        spin_lock(&dx->requests_lock);
-        list_del(&entry->list);
-        spin_unlock(&dx->requests_lock);
-        kfree(entry);
+        pr_debug( MODULE_NAME "%d: %s wake up.\n", num, __func__);
+        /* requests which arrived while the previous one was dispatched compete for the next pick */
+        for (;;)
+        {
+            int ret;
+            /*
+             * Pick once a credit is free, not before : run() must not sleep on a stale pick
+             * while an earlier deadline or a higher class arrives. Only dispatchers take
+             * credits and they hold dispatch_lock, so a credit seen under it stays free.
+             */
+            if (dsp->wait_credit && dsp->wait_credit(dsp) < 0)
+                break;
+            dxrt_sched_fetch(dx);
+            mutex_lock(&dx->dispatch_lock);
+            if (dsp->wait_credit && !READ_ONCE(dsp->credits)) {
+                /* taken by a direct dispatch */
+                mutex_unlock(&dx->dispatch_lock);
+                continue;
+            }
+            e = dxrt_sched_pick(dx);
+            if (!e) {
+                mutex_unlock(&dx->dispatch_lock);
+                break;
+            }
+            ret = dsp->run(dsp, &e->job);
+            if (ret < 0) {
+                pr_debug( MODULE_NAME "%d: %s req %d failed (%d)\n", num, __func__, e->job.request.req_id, ret);
+                dxrt_dsp_job_fail(&e->job, ret);
+            }
+            WRITE_ONCE(dx->dispatch_count, dx->dispatch_count + 1);
+            mutex_unlock(&dx->dispatch_lock);
+            dxrt_sched_put(&dx->sched, e);
+            if(kthread_should_stop()) break;
+        }
     }
+    /* drop the file references held by requests which will never be dispatched */
+    dxrt_sched_cancel(dx);
+    WRITE_ONCE(dx->dispatch_cpu_ns, dx->dispatch_cpu_ns + READ_ONCE(current->se.sum_exec_runtime));
     pr_debug( MODULE_NAME "%d: %s end.\n", num, __func__);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Scheduling of the request handler and of the DSP IRQ : set at load from dispatch_prio,
+ * changed at runtime through sysfs (dispatch_prio, dispatch_cpus, irq_cpus).
+ * dx->tune_lock serializes the changes with the start and the stop of the request handler,
+ * which is NULL while the device is not running.
+ */
+static int dxrt_dispatch_apply_prio(struct task_struct *t, uint32_t prio)
+{
+    struct sched_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = prio ? SCHED_FIFO : SCHED_NORMAL,
+        .sched_priority = prio,
+    };
+
+    return sched_setattr_nocheck(t, &attr);
+}
+
+/* @mask NULL : drops the hint, the current affinity of the IRQ is kept */
+static int dxrt_irq_hint(int irq, const struct cpumask *mask)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0))
+    if (!mask)
+        return irq_update_affinity_hint(irq, NULL);
+    return irq_set_affinity_and_hint(irq, mask);
+#else
+    return irq_set_affinity_hint(irq, mask);
+#endif
+}
+
+void dxrt_dispatch_start(struct dxdev *dx)
+{
+    struct task_struct *t;
+
+    t = kthread_run(dxrt_request_handler, (void*)dx, "dxrt-th%d", dx->id);
+    if (IS_ERR(t))
+    {
+        pr_err("%d: %s: failed to start the request handler (%ld)\n", dx->id, __func__, PTR_ERR(t));
+        return;
+    }
+    mutex_lock(&dx->tune_lock);
+    dx->request_handler = t;
+    dx->dispatch_prio = 0;
+    cpumask_copy(&dx->dispatch_cpus, cpu_possible_mask);
+    cpumask_clear(&dx->irq_cpus);
+    if (dispatch_prio && dispatch_prio < MAX_RT_PRIO && dxrt_dispatch_apply_prio(t, dispatch_prio) == 0)
+        dx->dispatch_prio = dispatch_prio;
+    mutex_unlock(&dx->tune_lock);
+}
+
+/*
+ * Before the DSP deinit : the affinity hint must be dropped before free_irq().
+ * The handler is cleared first, so that new submitters see the device stopped,
+ * and the queues are cancelled again once it is gone : a submitter which saw it
+ * running may have queued after its last dxrt_sched_cancel().
+ */
+void dxrt_dispatch_stop(struct dxdev *dx)
+{
+    struct task_struct *t;
+
+    mutex_lock(&dx->tune_lock);
+    t = dx->request_handler;
+    WRITE_ONCE(dx->request_handler, NULL);
+    if (!cpumask_empty(&dx->irq_cpus))
+    {
+        dxrt_irq_hint(dx->dsp->irq_num, NULL);
+        cpumask_clear(&dx->irq_cpus);
+    }
+    mutex_unlock(&dx->tune_lock);
+    if (t)
+    {
+        kthread_stop(t);
+        dxrt_sched_cancel(dx);
+    }
+}
+
+/* 1..99 : SCHED_FIFO at this priority, 0 : back to SCHED_NORMAL */
+int dxrt_dispatch_set_prio(struct dxdev *dx, uint32_t prio)
+{
+    int ret;
+
+    if (prio >= MAX_RT_PRIO)
+        return -EINVAL;
+    mutex_lock(&dx->tune_lock);
+    ret = dx->request_handler ? dxrt_dispatch_apply_prio(dx->request_handler, prio) : -ENODEV;
+    if (ret == 0)
+        WRITE_ONCE(dx->dispatch_prio, prio);
+    mutex_unlock(&dx->tune_lock);
+    pr_debug("%d: %s: %u (%d)\n", dx->id, __func__, prio, ret);
+    return ret;
+}
+
+/* An empty @mask allows every cpu again */
+int dxrt_dispatch_set_cpus(struct dxdev *dx, const struct cpumask *mask)
+{
+    int ret;
+
+    if (cpumask_empty(mask))
+        mask = cpu_possible_mask;
+    mutex_lock(&dx->tune_lock);
+    ret = dx->request_handler ? set_cpus_allowed_ptr(dx->request_handler, mask) : -ENODEV;
+    if (ret == 0)
+        cpumask_copy(&dx->dispatch_cpus, mask);
+    mutex_unlock(&dx->tune_lock);
+    pr_debug("%d: %s: %*pbl (%d)\n", dx->id, __func__, cpumask_pr_args(mask), ret);
+    return ret;
+}
+
+/*
+ * Moves the DSP IRQ to @mask and publishes it as the affinity hint, so that irqbalance
+ * keeps it there. An empty @mask drops the hint.
+ */
+int dxrt_dispatch_set_irq_cpus(struct dxdev *dx, const struct cpumask *mask)
+{
+    int ret = -ENODEV;
+
+    mutex_lock(&dx->tune_lock);
+    if (dx->request_handler)
+    {
+        /* the hint keeps a pointer to the mask : dx->irq_cpus, not @mask */
+        cpumask_copy(&dx->irq_cpus, mask);
+        ret = dxrt_irq_hint(dx->dsp->irq_num, cpumask_empty(mask) ? NULL : &dx->irq_cpus);
+        if (ret)
+        {
+            dxrt_irq_hint(dx->dsp->irq_num, NULL);
+            cpumask_clear(&dx->irq_cpus);
+        }
+    }
+    mutex_unlock(&dx->tune_lock);
+    pr_debug("%d: %s: %*pbl (%d)\n", dx->id, __func__, cpumask_pr_args(mask), ret);
+    return ret;
+}
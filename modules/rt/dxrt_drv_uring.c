@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include "dxrt_drv.h"
+
+#ifdef DXRT_HAS_URING_CMD
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0))
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+
+/* Stored in io_uring_cmd.pdu between the IRQ and the task work */
+struct dxrt_uring_pdu {
+    int32_t  res;
+    uint32_t req_id;
+    uint32_t inf_time;
+};
+
+static const dxrt_uring_cmd_t *dxrt_uring_cmd_payload(struct io_uring_cmd *ucmd)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0))
+    return io_uring_sqe_cmd(ucmd->sqe);
+#else
+    return ucmd->cmd;
+#endif
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0))
+static void dxrt_uring_cmd_done(struct io_uring_cmd *ucmd, unsigned int issue_flags)
+#else
+static void dxrt_uring_cmd_done(struct io_uring_cmd *ucmd)
+#endif
+{
+    struct dxrt_uring_pdu *pdu = (struct dxrt_uring_pdu *)ucmd->pdu;
+    u64 res2 = ((u64)pdu->inf_time << 32) | pdu->req_id;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0))
+    io_uring_cmd_done(ucmd, pdu->res, res2, issue_flags);
+#else
+    io_uring_cmd_done(ucmd, pdu->res, res2);
+#endif
+}
+
+/* Called from the IRQ handler / request handler, the CQE is posted from task work */
+void dxrt_uring_cmd_complete(struct io_uring_cmd *ucmd, const dxrt_completion_t *comp)
+{
+    struct dxrt_uring_pdu *pdu = (struct dxrt_uring_pdu *)ucmd->pdu;
+
+    BUILD_BUG_ON(sizeof(struct dxrt_uring_pdu) > sizeof(ucmd->pdu));
+    pdu->res = comp->response.status ? comp->response.status : (int32_t)comp->response.req_id;
+    pdu->req_id = comp->response.req_id;
+    pdu->inf_time = comp->response.inf_time;
+    io_uring_cmd_complete_in_task(ucmd, dxrt_uring_cmd_done);
+}
+
+/**
+ * dxrt_dev_uring_cmd - Submit a DSP request from an io_uring SQE
+ * @ucmd: The io_uring command, cmd_op DXRT_URING_CMD_SUBMIT, payload dxrt_uring_cmd_t
+ * @issue_flags: IO_URING_F_*
+ *
+ * The request is queued like write() and the command completes with a CQE
+ * once the DSP has finished, so no read()/poll() is required.
+ *
+ * Return: -EIOCBQUEUED when queued,
+ *        -EAGAIN   if the queue is full on a non-blocking issue (io_uring retries blocking)
+ *        -EFAULT   if an error occurs during the copy(user <-> kernel)
+ *        -EINVAL   if the request is invalid
+ *        -ENOTTY   if cmd_op is not supported
+ */
+int dxrt_dev_uring_cmd(struct io_uring_cmd *ucmd, unsigned int issue_flags)
+{
+    struct dxrt_file_ctx *ctx = ucmd->file->private_data;
+    const dxrt_uring_cmd_t *cmd = dxrt_uring_cmd_payload(ucmd);
+    dxrt_dsp_job_t job;
+    int ret;
+
+    if (ucmd->cmd_op != DXRT_URING_CMD_SUBMIT)
+        return -ENOTTY;
+    if (!ctx->dx->request_handler)
+        return -ENODEV;
+    if (copy_from_user(&job.request, u64_to_user_ptr(READ_ONCE(cmd->request)), sizeof(job.request)))
+        return -EFAULT;
+    if (job.request.req_id >= DSP_MSG_SLOT_NUM ||
+        job.request.msg_header.message_size > sizeof(job.request.msg_data))
+        return -EINVAL;
+    job.ucmd = ucmd;
+    job.deadline_ns = 0;
+    ret = dxrt_submit_jobs(ctx, &job, 1, issue_flags & IO_URING_F_NONBLOCK);
+    if (ret)
+        return ret;
+    return -EIOCBQUEUED;
+}
+#endif
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/uaccess.h>
+#include "dxrt_drv.h"
+
+#ifdef DXRT_HAS_USERPTR
+static enum dma_data_direction dxrt_userptr_dir(uint32_t flags)
+{
+    switch (flags & (DX_USERPTR_TO_DEVICE | DX_USERPTR_FROM_DEVICE)) {
+    case DX_USERPTR_TO_DEVICE:
+        return DMA_TO_DEVICE;
+    case DX_USERPTR_FROM_DEVICE:
+        return DMA_FROM_DEVICE;
+    default:
+        return DMA_BIDIRECTIONAL;
+    }
+}
+
+void dxrt_userptr_unmap(struct dxdev *dx, dxrt_handle_t *h)
+{
+    dma_unmap_sgtable(dx->dev, h->sgt, h->dir, 0);
+    sg_free_table(h->sgt);
+    kfree(h->sgt);
+    unpin_user_pages_dirty_lock(h->pages, h->npages, h->dir != DMA_TO_DEVICE);
+    account_locked_vm(h->mm, h->npages, false);
+    mmdrop(h->mm);
+    kvfree(h->pages);
+}
+
+/*
+ * DX_USERPTR_REGISTER : pins [addr, addr + size) for the life of the handle (FOLL_LONGTERM,
+ * charged to RLIMIT_MEMLOCK) and maps it for the DSP.
+ */
+int dxrt_userptr_register(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_userptr_t *arg)
+{
+    unsigned long start = arg->addr & PAGE_MASK;
+    unsigned long offset = arg->addr & ~PAGE_MASK;
+    unsigned int gup_flags = FOLL_LONGTERM;
+    dxrt_handle_t *h;
+    dma_addr_t addr;
+    size_t size;
+    int pinned = 0, ret;
+    u32 id;
+
+    if (arg->size == 0 || arg->size > U32_MAX || arg->addr + arg->size < arg->addr)
+        return -EINVAL;
+    h = kzalloc(sizeof(*h), GFP_KERNEL);
+    if (!h)
+        return -ENOMEM;
+    h->type = DXRT_HANDLE_USERPTR;
+    h->size = arg->size;
+    h->dir = dxrt_userptr_dir(arg->flags);
+    h->npages = DIV_ROUND_UP(offset + arg->size, PAGE_SIZE);
+    h->pages = kvmalloc_array(h->npages, sizeof(struct page *), GFP_KERNEL);
+    h->sgt = kzalloc(sizeof(*h->sgt), GFP_KERNEL);
+    if (!h->pages || !h->sgt)
+    {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+    h->mm = current->mm;
+    mmgrab(h->mm);
+    ret = account_locked_vm(h->mm, h->npages, true);
+    if (ret)
+        goto err_mm;
+
+    if (h->dir != DMA_TO_DEVICE)
+        gup_flags |= FOLL_WRITE;
+    while (pinned < h->npages)
+    {
+        ret = pin_user_pages_fast(start + (unsigned long)pinned * PAGE_SIZE, h->npages - pinned,
+            gup_flags, h->pages + pinned);
+        if (ret <= 0)
+        {
+            ret = ret ? ret : -EFAULT;
+            goto err_unpin;
+        }
+        pinned += ret;
+    }
+    ret = sg_alloc_table_from_pages(h->sgt, h->pages, h->npages, offset, arg->size, GFP_KERNEL);
+    if (ret)
+        goto err_unpin;
+    ret = dma_map_sgtable(dx->dev, h->sgt, h->dir, 0);
+    if (ret)
+        goto err_sgt;
+    /* one segment (or an IOMMU merged range) : the DSP can take the plain address */
+    if (dxrt_sgt_dev_addr(h->sgt, &addr, &size) == 0 && addr + size - 1 <= DMA_BIT_MASK(32))
+        h->dev_addr = addr;
+    ret = xa_alloc(&ctx->handles, &id, h, xa_limit_32b, GFP_KERNEL);
+    if (ret)
+        goto err_map;
+
+    arg->handle = id;
+    arg->dev_addr = h->dev_addr;
+    arg->nents = h->sgt->nents;
+    pr_debug("%d: %s: %llx + %llx -> handle %u addr %pad nents %u\n", dx->id, __func__,
+        arg->addr, arg->size, id, &h->dev_addr, h->sgt->nents);
+    return 0;
+
+err_map:
+    dma_unmap_sgtable(dx->dev, h->sgt, h->dir, 0);
+err_sgt:
+    sg_free_table(h->sgt);
+err_unpin:
+    unpin_user_pages(h->pages, pinned);
+    account_locked_vm(h->mm, h->npages, false);
+err_mm:
+    mmdrop(h->mm);
+err_free:
+    kfree(h->sgt);
+    kvfree(h->pages);
+    kfree(h);
+    return ret;
+}
+
+/* Caller holds ctx->handle_lock */
+static dxrt_handle_t *dxrt_userptr_lookup(struct dxrt_file_ctx *ctx, uint32_t handle)
+{
+    dxrt_handle_t *h = xa_load(&ctx->handles, handle);
+
+    if (!h || h->type != DXRT_HANDLE_USERPTR)
+        return NULL;
+    return h;
+}
+
+/* DX_USERPTR_GET_SG : copies the DSP segments, arg->nents must be the value returned by register */
+int dxrt_userptr_get_sg(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_userptr_t *arg)
+{
+    dxrt_userptr_sg_t __user *usg = (dxrt_userptr_sg_t __user *)arg->sg;
+    dxrt_userptr_sg_t seg = {0};
+    struct scatterlist *sg;
+    dxrt_handle_t *h;
+    int i, ret = 0;
+
+    mutex_lock(&ctx->handle_lock);
+    h = dxrt_userptr_lookup(ctx, arg->handle);
+    if (!h || arg->nents < h->sgt->nents)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+    for_each_sgtable_dma_sg(h->sgt, sg, i)
+    {
+        seg.dev_addr = sg_dma_address(sg);
+        seg.len = sg_dma_len(sg);
+        if (copy_to_user(usg + i, &seg, sizeof(seg)))
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+    }
+    arg->nents = h->sgt->nents;
+out:
+    mutex_unlock(&ctx->handle_lock);
+    return ret;
+}
+
+/*
+ * DX_USERPTR_SYNC : DX_USERPTR_TO_DEVICE after the CPU wrote the buffer and before the request,
+ * DX_USERPTR_FROM_DEVICE after the completion and before the CPU reads it.
+ */
+int dxrt_userptr_sync(struct dxdev *dx, struct dxrt_file_ctx *ctx, dxrt_userptr_t *arg)
+{
+    dxrt_handle_t *h;
+
+    mutex_lock(&ctx->handle_lock);
+    h = dxrt_userptr_lookup(ctx, arg->handle);
+    if (!h)
+    {
+        mutex_unlock(&ctx->handle_lock);
+        return -EINVAL;
+    }
+    if (arg->flags & DX_USERPTR_TO_DEVICE)
+        dma_sync_sgtable_for_device(dx->dev, h->sgt, h->dir);
+    if (arg->flags & DX_USERPTR_FROM_DEVICE)
+        dma_sync_sgtable_for_cpu(dx->dev, h->sgt, h->dir);
+    mutex_unlock(&ctx->handle_lock);
+    return 0;
+}
+#endif
@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deepx Runtime Driver
+ *
+ * Copyright (C) 2023 Deepx, Inc.
+ *
+ */
+#include <linux/version.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/huge_mm.h>
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0))
+#include <linux/pfn_t.h>
+#endif
+#include "dxrt_drv.h"
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0))
+#define mmap_read_lock(mm)      down_read(&(mm)->mmap_sem)
+#define mmap_read_unlock(mm)    up_read(&(mm)->mmap_sem)
+#endif
+
+static bool dram_mmap_owned_only = true;
+module_param(dram_mmap_owned_only, bool, 0644);
+MODULE_PARM_DESC(dram_mmap_owned_only, "DRAM mappings only expose the buffers allocated by the same fd (default true)");
+
+/*
+ * DRAM / SRAM mappings are filled on fault, nothing is mapped by mmap() itself.
+ * vm_pgoff holds the first pfn of the window, so that vma splits keep it right and
+ * the file offset of a page is its physical address (see dxrt_dram_zap()).
+ * DRAM faults map one PMD (2MB with 4K pages) where the user address and the DRAM
+ * address share the PMD alignment, single pages elsewhere or without DXRT_HAS_HUGE_PFNMAP.
+ * The page protection is chosen by dxrt_dev_mmap().
+ */
+static unsigned long dxrt_vma_pfn(struct vm_area_struct *vma, unsigned long addr)
+{
+    return vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+}
+
+/* The PMD block around @addr lies inside the vma and maps a PMD aligned block */
+static bool dxrt_vma_pmd_ok(struct vm_area_struct *vma, unsigned long addr)
+{
+    unsigned long start = addr & PMD_MASK;
+
+    return start >= vma->vm_start && start + PMD_SIZE <= vma->vm_end &&
+        !(dxrt_vma_pfn(vma, start) & ((PMD_SIZE >> PAGE_SHIFT) - 1));
+}
+
+/* Caller holds mem->lock, which also keeps buffers from being freed under the insert */
+static bool dxrt_dram_range_ok(struct dxrt_file_ctx *ctx, unsigned long pfn, unsigned long size)
+{
+    dxrt_dram_pool_t *mem = &ctx->dx->mem;
+    uint64_t offset = PFN_PHYS(pfn) - mem->base;
+
+    if (!dram_mmap_owned_only)
+        return true;
+    return dxrt_dram_owned(mem, ctx, offset, size);
+}
+
+/* Faults after remove fail : the window may belong to the next probe */
+static vm_fault_t dxrt_dram_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct dxrt_file_ctx *ctx = vma->vm_private_data;
+    unsigned long pfn = dxrt_vma_pfn(vma, vmf->address);
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+    int idx = dxrt_dev_enter(ctx->dx);
+
+    if (idx < 0)
+        return VM_FAULT_SIGBUS;
+    mutex_lock(&ctx->dx->mem.lock);
+    if (dxrt_dram_range_ok(ctx, pfn, PAGE_SIZE))
+        ret = vmf_insert_pfn(vma, vmf->address, pfn);
+    mutex_unlock(&ctx->dx->mem.lock);
+    dxrt_dev_exit(ctx->dx, idx);
+    return ret;
+}
+
+#ifdef DXRT_HAS_HUGE_PFNMAP
+static vm_fault_t dxrt_dram_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct dxrt_file_ctx *ctx = vma->vm_private_data;
+    vm_fault_t ret = VM_FAULT_FALLBACK;
+    unsigned long pfn;
+    int idx;
+
+    if (order != PMD_ORDER)
+        return VM_FAULT_FALLBACK;
+    if (!dxrt_vma_pmd_ok(vma, vmf->address))
+        return VM_FAULT_FALLBACK;
+    pfn = dxrt_vma_pfn(vma, vmf->address & PMD_MASK);
+    idx = dxrt_dev_enter(ctx->dx);
+    if (idx < 0)
+        return VM_FAULT_SIGBUS;
+    mutex_lock(&ctx->dx->mem.lock);
+    /* a block only partly owned is mapped page by page */
+    if (dxrt_dram_range_ok(ctx, pfn, PMD_SIZE))
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0))
+        ret = vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+        ret = vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+    mutex_unlock(&ctx->dx->mem.lock);
+    dxrt_dev_exit(ctx->dx, idx);
+    return ret;
+}
+#endif
+
+static const struct vm_operations_struct dxrt_dram_vm_ops = {
+    .fault = dxrt_dram_fault,
+#ifdef DXRT_HAS_HUGE_PFNMAP
+    .huge_fault = dxrt_dram_huge_fault,
+#endif
+};
+
+static vm_fault_t dxrt_sram_fault(struct vm_fault *vmf)
+{
+    struct dxrt_file_ctx *ctx = vmf->vma->vm_private_data;
+    vm_fault_t ret;
+    int idx = dxrt_dev_enter(ctx->dx);
+
+    if (idx < 0)
+        return VM_FAULT_SIGBUS;
+    ret = vmf_insert_pfn(vmf->vma, vmf->address, dxrt_vma_pfn(vmf->vma, vmf->address));
+    dxrt_dev_exit(ctx->dx, idx);
+    return ret;
+}
+
+static const struct vm_operations_struct dxrt_sram_vm_ops = {
+    .fault = dxrt_sram_fault,
+};
+
+static bool dxrt_vma_is_ours(struct vm_area_struct *vma)
+{
+    return vma->vm_ops == &dxrt_dram_vm_ops || vma->vm_ops == &dxrt_sram_vm_ops;
+}
+
+/*
+ * Lazy mapping of the window [base, base + size) : DRAM (@dram) or SRAM.
+ * vma->vm_page_prot is already set by the caller.
+ */
+int dxrt_vma_mmap(struct dxrt_file_ctx *ctx, struct vm_area_struct *vma, phys_addr_t base, size_t size,
+    bool dram)
+{
+    unsigned long flags = VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+
+    if (vma->vm_end - vma->vm_start > size)
+        return -EINVAL;
+    /* no copy-on-write of PFN mappings inserted on fault : MAP_SHARED only */
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE)
+        return -EINVAL;
+#ifdef DXRT_HAS_HUGE_PFNMAP
+    if (dram)
+        flags |= VM_HUGEPAGE;
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0))
+    vm_flags_set(vma, flags);
+#else
+    vma->vm_flags |= flags;
+#endif
+    vma->vm_pgoff = PHYS_PFN(base);
+    vma->vm_ops = dram ? &dxrt_dram_vm_ops : &dxrt_sram_vm_ops;
+    vma->vm_private_data = ctx;
+    return 0;
+}
+
+/* Next address to populate : the whole PMD when the DRAM fault maps it at once */
+static unsigned long dxrt_vma_populate_next(struct vm_area_struct *vma, unsigned long addr)
+{
+#ifdef DXRT_HAS_HUGE_PFNMAP
+    struct dxrt_file_ctx *ctx = vma->vm_private_data;
+    bool pmd = false;
+
+    if (vma->vm_ops == &dxrt_dram_vm_ops && dxrt_vma_pmd_ok(vma, addr))
+    {
+        mutex_lock(&ctx->dx->mem.lock);
+        pmd = dxrt_dram_range_ok(ctx, dxrt_vma_pfn(vma, addr & PMD_MASK), PMD_SIZE);
+        mutex_unlock(&ctx->dx->mem.lock);
+    }
+    if (pmd)
+        return (addr & PMD_MASK) + PMD_SIZE;
+#endif
+    return addr + PAGE_SIZE;
+}
+
+/*
+ * Drops the user mappings of a DRAM range which left its owner (freed buffer) :
+ * the file offset of a mapped page is its physical address.
+ * Caller holds mem->lock, so that no fault maps the range again before it is unlinked.
+ */
+void dxrt_dram_zap(struct dxrt_file_ctx *ctx, phys_addr_t addr, size_t size)
+{
+    if (ctx->mapping)
+        unmap_mapping_range(ctx->mapping, (loff_t)addr, size, 1);
+}
+
+static unsigned long dxrt_mm_get_unmapped_area(struct file *f, unsigned long addr, unsigned long len,
+    unsigned long flags)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0))
+    return mm_get_unmapped_area(current->mm, f, addr, len, 0, flags);
+#else
+    return current->mm->get_unmapped_area(f, addr, len, 0, flags);
+#endif
+}
+
+/*
+ * DRAM mappings are placed so that the user address has the PMD alignment of the
+ * DRAM base : every fully covered 2MB block can then be mapped by one PMD.
+ * Without DXRT_HAS_HUGE_PFNMAP the placement is left to the mm.
+ */
+unsigned long dxrt_dev_get_unmapped_area(struct file *f, unsigned long addr, unsigned long len,
+    unsigned long pgoff, unsigned long flags)
+{
+#ifdef DXRT_HAS_HUGE_PFNMAP
+    struct dxrt_file_ctx *ctx = f->private_data;
+    unsigned long ret;
+
+    if ((flags & MAP_FIXED) || len < PMD_SIZE ||
+        (pgoff != DXRT_MMAP_DRAM && pgoff != DXRT_MMAP_DRAM_CACHED && pgoff != DXRT_MMAP_DRAM_WC))
+        return dxrt_mm_get_unmapped_area(f, addr, len, flags);
+    ret = dxrt_mm_get_unmapped_area(f, 0, len + PMD_SIZE, flags);
+    if (IS_ERR_VALUE(ret))
+        return ret;
+    return ret + ((ctx->dx->mem.base - ret) & (PMD_SIZE - 1));
+#else
+    return dxrt_mm_get_unmapped_area(f, addr, len, flags);
+#endif
+}
+
+/*
+ * DXRT_CMD_MMAP_POPULATE : faults in [start, start + len) of a DRAM / SRAM mapping of this file,
+ * a PMD at a time where possible. MAP_POPULATE does not apply to VM_PFNMAP mappings.
+ */
+int dxrt_dram_populate(struct dxrt_file_ctx *ctx, unsigned long start, unsigned long len)
+{
+    struct mm_struct *mm = current->mm;
+    struct vm_area_struct *vma;
+    unsigned long addr, end = start + len;
+    unsigned int fault_flags;
+    int ret = 0;
+
+    if (len == 0 || end < start)
+        return -EINVAL;
+    mmap_read_lock(mm);
+    vma = find_vma(mm, start);
+    if (!vma || !dxrt_vma_is_ours(vma) || vma->vm_private_data != ctx ||
+        start < vma->vm_start || end > vma->vm_end)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+    fault_flags = (vma->vm_flags & VM_WRITE) ? FAULT_FLAG_WRITE : 0;
+    for (addr = start & PAGE_MASK; addr < end; )
+    {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0))
+        ret = fixup_user_fault(mm, addr, fault_flags, NULL);
+#else
+        ret = fixup_user_fault(current, mm, addr, fault_flags, NULL);
+#endif
+        if (ret)
+            break;
+        addr = dxrt_vma_populate_next(vma, addr);
+    }
+out:
+    mmap_read_unlock(mm);
+    return ret;
+}